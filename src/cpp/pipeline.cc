@@ -1,181 +1,672 @@
 #include "pipeline.h"
 
 #include <ranges>
+#include <stdexcept>
+#include <unordered_map>
 
 #include "vektor/canny_edge_detector.h"
 #include "vektor/renderer.h"
+#include "vektor/tiling.h"
 #include "vektor/tracer.h"
 
 namespace Vektor {
 
-bool BlurStage::update(
-  const RawRGBImage& source_image,
-  const PipelineConfig& config,
-  bool to_update
+namespace {
+
+// Mixed into every key so that the stages never share cache entries.
+enum class StageTag : std::uint64_t {
+  source = 1,
+  blur,
+  gradient,
+  thinning,
+  threshold,
+  hysteresis,
+  weak_components,
+  tracing,
+  greyscale_plot,
+  color_plot
+};
+
+// What the images hold, padding included.
+template <typename T>
+std::size_t byte_size(const Image::Image<T>& image) {
+  return image.data().size() * sizeof(T);
+}
+
+std::size_t byte_size(const Image::PlanarRGBImage& image) {
+  return image.data().size() * sizeof(float);
+}
+
+std::size_t byte_size(const Image::GradientImage& image) {
+  return byte_size(image.magnitudes) + byte_size(image.directions);
+}
+
+std::size_t byte_size(const Image::BinaryImage& image) {
+  return image.data().size() * sizeof(Image::BinaryImage::Word);
+}
+
+// The image plus its RGBA bytes, once they have been materialized.
+template <typename T>
+std::size_t byte_size(const ImageWithBytes<T>& image) {
+  return byte_size(image.image()) + image.nr_materialized_bytes();
+}
+
+template <typename T>
+std::size_t byte_size(const std::vector<T>& values) {
+  return values.size() * sizeof(T);
+}
+
+std::size_t byte_size(const Canny::EdgePixels& edges) {
+  return (edges.row_offsets.size() + edges.xs.size() + edges.histogram.size()) * sizeof(int) +
+         edges.magnitudes.size() * sizeof(float);
+}
+
+std::size_t byte_size(const Canny::WeakComponents& components) {
+  return byte_size(components.base) +
+         (components.offsets.size() + components.pixels.size() +
+          components.strong_offsets.size() + components.strong_pixels.size()) *
+           sizeof(int);
+}
+
+template <typename T>
+std::size_t byte_size(const T&) {
+  return sizeof(T);
+}
+
+// Points `result` at the value for `key`, from the cache or else by calling compute(), which
+// returns either the value or a shared result. Returns whether the result changed.
+template <typename T>
+bool update_result(
+  Shared<T>& result,
+  Fingerprint& fingerprint,
+  Fingerprint key,
+  StageCache& cache,
+  auto&& compute
 ) {
-  if (to_update || config.kernel_size != m_kernel_size || config.nr_iterations != m_nr_iterations) {
-    m_kernel_size = config.kernel_size;
-    m_nr_iterations = config.nr_iterations;
-    constexpr float h = 1.0f;
-    result = Canny::apply_adaptive_blur(source_image.image(), h, m_kernel_size, m_nr_iterations);
-    return true;
+  if (key == fingerprint) return false;
+
+  if (auto cached = cache.find<T>(key)) {
+    result = std::move(cached);
+  } else {
+    if constexpr (std::same_as<decltype(compute()), Shared<T>>) {
+      result = compute();
+    } else {
+      result = std::make_shared<const T>(compute());
+    }
+    cache.insert(key, result, byte_size(*result));
   }
-  return false;
+  fingerprint = key;
+  return true;
 }
 
-bool GradientStage::update(const RawRGBImage& blurred_image, bool to_update) {
-  if (to_update) {
-    result = Canny::compute_gradient(blurred_image.image());
-    return true;
+// Hashes the pixels tile by tile in parallel and chains the tile hashes in order.
+Fingerprint fingerprint_of(const Image::PlanarRGBImage& image) {
+  const int width = image.width();
+  auto tiles = Image::make_tiles(width, image.height(), 0);
+
+  std::vector<Fingerprint> tile_hashes(tiles.size());
+  Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int i) {
+    Fingerprint hash = 0;
+    for (int y = tiles[i].y_begin; y < tiles[i].y_end; ++y) {
+      for (int x = 0; x < width; ++x) {
+        glm::vec3 color = image[x, y];
+        hash = chain(hash, color.r, color.g, color.b);
+      }
+    }
+    tile_hashes[i] = hash;
+  });
+
+  Fingerprint hash = chain(std::to_underlying(StageTag::source), width, image.height());
+  for (auto tile_hash : tile_hashes) {
+    hash = combine(hash, tile_hash);
   }
-  return false;
+  return hash;
 }
 
-bool ThinningStage::update(const RawGradientImage& gradient_image, bool to_update) {
-  if (to_update) {
-    result = Canny::thin_edges(gradient_image.image());
-    return true;
+// Converts 8-bit RGBA pixels straight into the padded float planes the blur reads.
+Image::PlanarRGBImage rgb_from_rgba(std::span<const std::byte> rgba, int width, int height) {
+  if (width < 0 || height < 0 || rgba.size() != 4 * static_cast<std::size_t>(width) * height) {
+    throw std::invalid_argument("RGBA buffer does not match the image size");
   }
-  return false;
+
+  Image::PlanarRGBImage rgb_image { width, height, Canny::padding_requirement };
+  Image::apply_tiled(width, height, [&](int x, int y) {
+    const auto* pixel = &rgba[4 * (static_cast<std::size_t>(y) * width + x)];
+    for (int c = 0; c < Image::PlanarRGBImage::NR_CHANNELS; ++c) {
+      rgb_image[x, y, c] = static_cast<float>(pixel[c]) / 255.0f;
+    }
+  });
+  return rgb_image;
+}
+
+}  // namespace
+
+void BlurStage::update(
+  const RawPlanarRGBImage& source_image,
+  Fingerprint source_fingerprint,
+  const PipelineConfig& config,
+  StageCache& cache
+) {
+  // The result after k iterations is cached under the key of a config with nr_iterations = k.
+  auto key_for = [&](int nr_iterations) {
+    return chain(source_fingerprint, StageTag::blur, config.kernel_size, nr_iterations);
+  };
+
+  update_result(result, fingerprint, key_for(config.nr_iterations), cache, [&] {
+    // Resume from the furthest iteration still cached, and cache every iteration on the way, so
+    // one more iteration costs one iteration and fewer cost nothing.
+    // The source image is already padded for the blur, so the first iteration reads it as is.
+    int iteration = config.nr_iterations - 1;
+    Shared<RawPlanarRGBImage> current;
+    while (iteration > 0 && !(current = cache.find<RawPlanarRGBImage>(key_for(iteration)))) {
+      --iteration;
+    }
+    if (!current) iteration = 0;
+
+    constexpr float h = 1.0f;
+    for (; iteration < config.nr_iterations; ++iteration) {
+      Parallel::check_cancelled();
+      const auto& input = current ? current->image() : source_image.image();
+      current = std::make_shared<const RawPlanarRGBImage>(
+        Canny::apply_adaptive_blur_iteration(input, h, config.kernel_size),
+        materialize_bytes
+      );
+      if (iteration + 1 < config.nr_iterations) {
+        cache.insert(key_for(iteration + 1), current, byte_size(*current));
+      }
+    }
+    return current;
+  });
+}
+
+void GradientStage::update(
+  const RawPlanarRGBImage& blurred_image,
+  Fingerprint blurred_fingerprint,
+  StageCache& cache
+) {
+  auto key = chain(blurred_fingerprint, StageTag::gradient);
+  update_result(result, fingerprint, key, cache, [&] {
+    return RawGradientImage { Canny::compute_gradient(blurred_image.image()), materialize_bytes };
+  });
 }
 
-bool ThresholdStage::update(const RawGreyscaleImage& thinned_image, bool to_update) {
-  if (to_update) {
-    std::tie(tl, th) = Canny::compute_threshold(thinned_image.image());
-    return true;
+void ThinningStage::update(
+  const RawGradientImage& gradient_image,
+  Fingerprint gradient_fingerprint,
+  StageCache& cache
+) {
+  auto key = chain(gradient_fingerprint, StageTag::thinning);
+  bool changed = update_result(edges, fingerprint, key, cache, [&] {
+    return Canny::thin_edges(gradient_image.image());
+  });
+  if (changed) {
+    result =
+      std::make_shared<const RawGreyscaleImage>(Canny::to_image(*edges), materialize_bytes);
   }
-  return false;
 }
 
-bool HysteresisStage::update(
-  const RawGreyscaleImage& thinned_image,
+void ThresholdStage::update(
+  const Canny::EdgePixels& edges,
+  Fingerprint thinned_fingerprint,
+  StageCache& cache
+) {
+  Shared<std::pair<float, float>> thresholds;
+  auto key = chain(thinned_fingerprint, StageTag::threshold);
+  if (key == fingerprint) return;
+
+  Fingerprint computed = 0;
+  update_result(thresholds, computed, key, cache, [&] {
+    return Canny::compute_threshold(edges);
+  });
+  std::tie(tl, th) = *thresholds;
+  fingerprint = key;
+}
+
+void HysteresisStage::update(
+  const Canny::EdgePixels& edges,
   float tl,
   float th,
+  Fingerprint threshold_fingerprint,
   const PipelineConfig& config,
-  bool to_update
+  StageCache& cache
 ) {
-  if (to_update || config.take_percentile != m_take_percentile) {
-    m_take_percentile = config.take_percentile;
-    result = Canny::apply_hysteresis(thinned_image.image(), tl, th, m_take_percentile);
-    return true;
-  }
-  return false;
+  const bool same_components = fingerprint != 0 && threshold_fingerprint == m_threshold_fingerprint;
+
+  // The components are kept current even when the image is cached, since tracing reads them.
+  auto components_key = chain(threshold_fingerprint, StageTag::weak_components);
+  update_result(components, components_fingerprint, components_key, cache, [&] {
+    return Canny::label_weak_components(edges, tl, th);
+  });
+
+  auto key = chain(threshold_fingerprint, StageTag::hysteresis, config.take_percentile);
+  update_result(result, fingerprint, key, cache, [&] {
+    // The tracing stage takes the same components from the lists, and counts them.
+    int taken = Canny::nr_taken_components(*components, config.take_percentile);
+    if (!same_components) {
+      auto image = components->base;
+      Canny::paint_components(*components, 0, taken, true, image);
+      return RawBinaryImage { std::move(image), materialize_bytes };
+    }
+
+    // Results are immutable, and the cache and the completed state always share the current one,
+    // so it is copied before the cut is moved. The copy is a plain copy of the bits, an eighth of
+    // a byte a pixel; only painting the components follows the number of changed pixels.
+    int previously_taken = Canny::nr_taken_components(*components, m_take_percentile);
+    auto image = result->image();
+    if (taken > previously_taken) {
+      Canny::paint_components(*components, previously_taken, taken, true, image);
+    } else {
+      Canny::paint_components(*components, taken, previously_taken, false, image);
+    }
+    return RawBinaryImage { std::move(image), materialize_bytes };
+  });
+
+  m_threshold_fingerprint = threshold_fingerprint;
+  m_take_percentile = config.take_percentile;
 }
 
-bool TracingStage::update(
-  const RawBinaryImage& hysteresis_image,
-  const RawRGBImage& source_image,
-  bool to_update
+void TracingStage::update(
+  const Canny::WeakComponents& edge_components,
+  float take_percentile,
+  const RawPlanarRGBImage& source_image,
+  Fingerprint hysteresis_fingerprint,
+  Fingerprint source_fingerprint,
+  Renderer::FlattenCache& flatten_cache,
+  StageCache& cache
 ) {
-  if (to_update) {
-    curves = Tracer::trace(hysteresis_image.image()) |
-             std::ranges::to<std::vector<BezierCurveWithColor>>();
+  auto key = chain(hysteresis_fingerprint, StageTag::tracing, source_fingerprint);
+  update_result(curves, fingerprint, key, cache, [&] {
+    const auto& previous = *m_components;
+    auto traced = std::make_shared<Components>();
+    traced->components = Tracer::trace_components(
+      source_image.width(),
+      Canny::kept_components(edge_components, take_percentile),
+      previous.components
+    );
+    traced->source_fingerprint = source_fingerprint;
 
-    for (auto& [curve, color] : curves) {
-      color = Renderer::compute_curve_color(curve, source_image.image());
+    std::unordered_map<std::uint64_t, const std::vector<glm::vec3>*> previous_colors;
+    if (previous.source_fingerprint == source_fingerprint) {
+      for (std::size_t c = 0; c < previous.components.size(); ++c) {
+        previous_colors.emplace(previous.components[c].fingerprint, &previous.colors[c]);
+      }
     }
 
-    return true;
-  }
-  return false;
+    // Colours the curves of the new components in one batch.
+    const auto& components = traced->components;
+    auto& colors = traced->colors;
+    colors.resize(components.size());
+    std::vector<BezierCurveWithColor> uncolored;
+    for (std::size_t c = 0; c < components.size(); ++c) {
+      if (auto it = previous_colors.find(components[c].fingerprint); it != previous_colors.end()) {
+        colors[c] = *it->second;
+      } else {
+        uncolored.insert(uncolored.end(), components[c].curves.begin(), components[c].curves.end());
+      }
+    }
+    Renderer::compute_curve_colors(uncolored, source_image.image(), flatten_cache);
+
+    auto next_color = uncolored.begin();
+    for (std::size_t c = 0; c < components.size(); ++c) {
+      if (!colors[c].empty() || components[c].curves.empty()) continue;
+      for (std::size_t i = 0; i < components[c].curves.size(); ++i) {
+        colors[c].push_back((next_color++)->color);
+      }
+    }
+
+    std::vector<BezierCurveWithColor> result;
+    Tracer::for_each_path_in_order(components, [&](int c, int p) {
+      const auto& component = components[c];
+      for (int i = component.offsets[p]; i < component.offsets[p + 1]; ++i) {
+        result.emplace_back(component.curves[i], colors[c][i]);
+      }
+    });
+
+    m_components = std::move(traced);
+    return result;
+  });
 }
 
-bool PlottingStage::update(
+void PlottingStage::update(
   const std::vector<BezierCurveWithColor>& curves,
-  const RawRGBImage& source_image,
+  const RawPlanarRGBImage& source_image,
+  Fingerprint curves_fingerprint,
   const PipelineConfig& config,
-  bool to_update
+  Renderer::FlattenCache& flatten_cache,
+  StageCache& cache
 ) {
-  if (to_update || config.plot_scale != m_plot_scale ||
-      config.background_color != m_background_color) {
-    m_plot_scale = config.plot_scale;
-    m_background_color = config.background_color;
-
-    auto plot_width = static_cast<float>(source_image.width() * m_plot_scale);
-    auto plot_height = static_cast<float>(source_image.height() * m_plot_scale);
-
-    greyscale_plot = Renderer::render_greyscale(
-      plot_width,
-      plot_height,
-      curves,
-      m_background_color == PipelineConfig::BackgroundColor::black ? 0.0f : 1.0f
-    );
+  auto plot_width = static_cast<float>(source_image.width() * config.plot_scale);
+  auto plot_height = static_cast<float>(source_image.height() * config.plot_scale);
+  auto background_value =
+    config.background_color == PipelineConfig::BackgroundColor::black ? 0.0f : 1.0f;
 
-    color_plot = Renderer::render_color(
-      plot_width,
-      plot_height,
-      curves,
-      m_background_color == PipelineConfig::BackgroundColor::black ? glm::vec3(0.0f)
-                                                                   : glm::vec3(1.0f)
-    );
+  auto key = chain(curves_fingerprint, config.plot_scale, config.background_color);
+  if (key == fingerprint) return;
+
+  auto render_greyscale = [&] {
+    return RawGreyscaleImage {
+      Renderer::render_greyscale(plot_width, plot_height, curves, background_value, flatten_cache),
+      materialize_bytes
+    };
+  };
+  auto render_color = [&] {
+    return RawRGBImage {
+      Renderer::render_color(
+        plot_width,
+        plot_height,
+        curves,
+        glm::vec3(background_value),
+        flatten_cache
+      ),
+      materialize_bytes
+    };
+  };
 
-    return true;
+  Fingerprint greyscale_fingerprint = 0, color_fingerprint = 0;
+  auto greyscale_key = chain(key, StageTag::greyscale_plot);
+  auto color_key = chain(key, StageTag::color_plot);
+  update_result(greyscale_plot, greyscale_fingerprint, greyscale_key, cache, render_greyscale);
+  update_result(color_plot, color_fingerprint, color_key, cache, render_color);
+  fingerprint = key;
+}
+
+Pipeline::Pipeline(bool materialize_bytes) : m_materialize_bytes { materialize_bytes } {
+  for (auto* state : { &m_state, &m_completed }) {
+    state->blur.materialize_bytes = materialize_bytes;
+    state->gradient.materialize_bytes = materialize_bytes;
+    state->thinning.materialize_bytes = materialize_bytes;
+    state->hysteresis.materialize_bytes = materialize_bytes;
+    state->plotting.materialize_bytes = materialize_bytes;
   }
-  return false;
+
+#if VEKTOR_HAS_THREADS
+  m_worker = std::jthread { [this](std::stop_token stop) { worker_loop(stop); } };
+#endif
+}
+
+Pipeline::~Pipeline() {
+  cancel_async_run();
 }
 
 const RawRGBAImage& Pipeline::source_image() const noexcept {
-  return m_source_image_rgba;
+  return *m_state.source_image_rgba;
 }
 
-const RawRGBImage& Pipeline::blurred_image() const noexcept {
-  return m_blur.result;
+const RawPlanarRGBImage& Pipeline::blurred_image() const noexcept {
+  return *m_state.blur.result;
 }
 
 const RawGradientImage& Pipeline::gradient_image() const noexcept {
-  return m_gradient.result;
+  return *m_state.gradient.result;
 }
 
 const RawGreyscaleImage& Pipeline::thinned_image() const noexcept {
-  return m_thinning.result;
+  return *m_state.thinning.result;
 }
 
 const RawBinaryImage& Pipeline::hysteresis_image() const noexcept {
-  return m_hysteresis.result;
+  return *m_state.hysteresis.result;
 }
 
 const RawGreyscaleImage& Pipeline::greyscale_plot() const noexcept {
-  return m_plotting.greyscale_plot;
+  return *m_state.plotting.greyscale_plot;
 }
 
 const RawRGBImage& Pipeline::color_plot() const noexcept {
-  return m_plotting.color_plot;
+  return *m_state.plotting.color_plot;
 }
 
 const std::vector<BezierCurveWithColor>& Pipeline::curves() const noexcept {
-  return m_tracing.curves;
+  return *m_state.tracing.curves;
+}
+
+void Pipeline::set_source_image(std::vector<std::byte>&& rgba, int width, int height) {
+  auto rgb_image = rgb_from_rgba(rgba, width, height);
+  set_source(
+    RawRGBAImage { std::move(rgba), width, height },
+    RawPlanarRGBImage { std::move(rgb_image), m_materialize_bytes }
+  );
+}
+
+void Pipeline::set_source_image(std::span<const std::byte> rgba, int width, int height) {
+  auto rgb_image = rgb_from_rgba(rgba, width, height);
+  // Only the source view reads the bytes after this call.
+  std::vector<std::byte> bytes;
+  if (m_materialize_bytes) bytes.assign(rgba.begin(), rgba.end());
+  set_source(
+    RawRGBAImage { std::move(bytes), width, height },
+    RawPlanarRGBImage { std::move(rgb_image), m_materialize_bytes }
+  );
+}
+
+void Pipeline::set_source_image(const Image::RGBAImage& image) {
+  const int width = image.width();
+  const int height = image.height();
+
+  std::vector<std::byte> rgba(4 * static_cast<std::size_t>(width) * height);
+  Image::PlanarRGBImage rgb_image { width, height, Canny::padding_requirement };
+  Image::apply(width, height, [&](int x, int y) {
+    glm::vec4 color = image[x, y];
+    for (int c = 0; c < Image::PlanarRGBImage::NR_CHANNELS; ++c) {
+      rgb_image[x, y, c] = color[c];
+    }
+
+    glm::vec4 value = glm::clamp(color * 255.0f, 0.0f, 255.0f);
+    for (int c = 0; c < 4; ++c) {
+      rgba[4 * (static_cast<std::size_t>(y) * width + x) + c] = static_cast<std::byte>(value[c]);
+    }
+  });
+
+  set_source(
+    RawRGBAImage { std::move(rgba), width, height },
+    RawPlanarRGBImage { std::move(rgb_image), m_materialize_bytes }
+  );
+}
+
+void Pipeline::set_source(RawRGBAImage&& rgba_image, RawPlanarRGBImage&& rgb_image) {
+  supersede_async_run();
+
+  m_state.source_image_rgba = std::make_shared<const RawRGBAImage>(std::move(rgba_image));
+  m_state.source_image_rgb = std::make_shared<const RawPlanarRGBImage>(std::move(rgb_image));
+  m_state.source_fingerprint = fingerprint_of(m_state.source_image_rgb->image());
+  run_pipeline(m_state);
+
+  std::lock_guard lock { m_mutex };
+  m_completed = m_state;
 }
 
 void Pipeline::set_config(Pipeline::Config config) {
-  m_config = config;
-  run_pipeline(false);
+  supersede_async_run();
+
+  m_state.config = config;
+  run_pipeline(m_state);
+
+  std::lock_guard lock { m_mutex };
+  m_completed = m_state;
+}
+
+void Pipeline::set_config_async(Pipeline::Config config) {
+#if VEKTOR_HAS_THREADS
+  {
+    std::lock_guard lock { m_mutex };
+    m_request = config;
+    m_run_stop.request_stop();
+  }
+  m_wake.notify_one();
+#else
+  set_config(config);
+  std::lock_guard lock { m_mutex };
+  m_has_update = true;
+#endif
+}
+
+bool Pipeline::poll() {
+  std::lock_guard lock { m_mutex };
+  if (m_error) {
+    std::rethrow_exception(std::exchange(m_error, nullptr));
+  }
+  if (!m_has_update) return false;
+
+  m_state = m_completed;
+  m_has_update = false;
+  return true;
 }
 
 Pipeline::Config Pipeline::config() const noexcept {
-  return m_config;
+  return m_state.config;
+}
+
+void Pipeline::set_cache_budget(std::size_t budget) {
+  cancel_async_run();
+  m_stage_cache.set_budget(budget);
+}
+
+void Pipeline::set_profiling(bool profiling) noexcept {
+  m_profiling = profiling;
 }
 
-void Pipeline::run_pipeline(bool dirty) {
-  if (m_source_image_rgba.width() == 0 || m_source_image_rgba.height() == 0) {
-    m_blur.result.clear();
-    m_gradient.result.clear();
-    m_thinning.result.clear();
-    m_threshold.th = m_threshold.tl = 0.0;
-    m_hysteresis.result.clear();
-    m_tracing.curves.clear();
-    m_plotting.color_plot.clear();
-    m_plotting.greyscale_plot.clear();
+const Profiler::Profile& Pipeline::profile() const noexcept {
+  return m_state.profile;
+}
+
+void Pipeline::cancel_async_run() {
+  std::unique_lock lock { m_mutex };
+  m_request.reset();
+  m_run_stop.request_stop();
+  m_idle.wait(lock, [&] { return !m_running; });
+}
+
+void Pipeline::supersede_async_run() {
+  cancel_async_run();
+
+  // The run that follows starts from the latest completed state and reports its own errors, so
+  // those of an earlier asynchronous run are dropped rather than thrown from here.
+  std::lock_guard lock { m_mutex };
+  m_error = nullptr;
+  if (std::exchange(m_has_update, false)) m_state = m_completed;
+}
+
+void Pipeline::worker_loop(std::stop_token stop) {
+  while (true) {
+    State state;
+    std::stop_token run_stop;
+    {
+      std::unique_lock lock { m_mutex };
+      if (!m_wake.wait(lock, stop, [&] { return m_request.has_value(); })) return;
+
+      // Runs always start from the latest completed state, so a cancelled run leaves nothing
+      // half done behind and the next one recomputes whatever it had not finished.
+      state = m_completed;
+      state.config = *std::exchange(m_request, std::nullopt);
+      m_run_stop = {};
+      run_stop = m_run_stop.get_token();
+      m_running = true;
+    }
+
+    bool completed = false;
+    std::exception_ptr error;
+    try {
+      Parallel::CancellationScope scope { run_stop };
+      run_pipeline(state);
+      completed = true;
+    } catch (const Parallel::Cancelled&) {
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    {
+      std::lock_guard lock { m_mutex };
+      if (completed) {
+        m_completed = std::move(state);
+        m_has_update = true;
+      }
+      if (error) m_error = error;
+      m_running = false;
+    }
+    m_idle.notify_all();
+  }
+}
+
+void Pipeline::run_pipeline(State& state) {
+  state.profile = {};
+  if (state.source_image_rgba->width() == 0 || state.source_image_rgba->height() == 0) {
+    state.blur.result = std::make_shared<const RawPlanarRGBImage>();
+    state.gradient.result = std::make_shared<const RawGradientImage>();
+    state.thinning.edges = std::make_shared<const Canny::EdgePixels>();
+    state.thinning.result = std::make_shared<const RawGreyscaleImage>();
+    state.threshold.th = state.threshold.tl = 0.0;
+    state.hysteresis.result = std::make_shared<const RawBinaryImage>();
+    state.tracing.curves = std::make_shared<const std::vector<BezierCurveWithColor>>();
+    state.plotting.color_plot = std::make_shared<const RawRGBImage>();
+    state.plotting.greyscale_plot = std::make_shared<const RawGreyscaleImage>();
+
+    state.blur.fingerprint = state.gradient.fingerprint = state.thinning.fingerprint = 0;
+    state.threshold.fingerprint = state.hysteresis.fingerprint = 0;
+    state.tracing.fingerprint = state.plotting.fingerprint = 0;
+    m_flatten_cache.clear();
+    m_stage_cache.clear();
 
     return;
   }
 
-  dirty = m_blur.update(m_source_image_rgb, m_config, dirty);
-  dirty = m_gradient.update(m_blur.result, dirty);
-  dirty = m_thinning.update(m_gradient.result, dirty);
-  dirty = m_threshold.update(m_thinning.result, dirty);
-  dirty = m_hysteresis.update(m_thinning.result, m_threshold.tl, m_threshold.th, m_config, dirty);
-  dirty = m_tracing.update(m_hysteresis.result, m_source_image_rgb, dirty);
-  m_plotting.update(m_tracing.curves, m_source_image_rgb, m_config, dirty);
+  const auto& config = state.config;
+  const auto& source_image_rgb = *state.source_image_rgb;
+
+  // Stages served from the caches show up with their lookup time and no counts.
+  std::optional<Profiler::Session> session;
+  if (m_profiling) session.emplace(state.profile);
+  using Profiler::timed;
+
+  Parallel::check_cancelled();
+  timed("blur", [&] {
+    state.blur.update(source_image_rgb, state.source_fingerprint, config, m_stage_cache);
+  });
+  Parallel::check_cancelled();
+  timed("gradient", [&] {
+    state.gradient.update(*state.blur.result, state.blur.fingerprint, m_stage_cache);
+  });
+  Parallel::check_cancelled();
+  timed("thinning", [&] {
+    state.thinning.update(*state.gradient.result, state.gradient.fingerprint, m_stage_cache);
+  });
+  Parallel::check_cancelled();
+  timed("threshold", [&] {
+    state.threshold.update(*state.thinning.edges, state.thinning.fingerprint, m_stage_cache);
+  });
+  Parallel::check_cancelled();
+  timed("hysteresis", [&] {
+    state.hysteresis.update(
+      *state.thinning.edges,
+      state.threshold.tl,
+      state.threshold.th,
+      state.threshold.fingerprint,
+      config,
+      m_stage_cache
+    );
+  });
+  Parallel::check_cancelled();
+  timed("tracing", [&] {
+    state.tracing.update(
+      *state.hysteresis.components,
+      config.take_percentile,
+      source_image_rgb,
+      state.hysteresis.fingerprint,
+      state.source_fingerprint,
+      m_flatten_cache,
+      m_stage_cache
+    );
+  });
+  Parallel::check_cancelled();
+  timed("plotting", [&] {
+    state.plotting.update(
+      *state.tracing.curves,
+      source_image_rgb,
+      state.tracing.fingerprint,
+      config,
+      m_flatten_cache,
+      m_stage_cache
+    );
+  });
 }
 
 }  // namespace Vektor
\ No newline at end of file
@@ -1,24 +1,67 @@
 #pragma once
 
+#include <atomic>
 #include <concepts>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "glm/common.hpp"
+#include "stage_cache.h"
 #include "vektor/bezier_curve.h"
+#include "vektor/canny_edge_detector.h"
 #include "vektor/image.h"
+#include "vektor/planar_image.h"
+#include "vektor/profiler.h"
+#include "vektor/renderer.h"
+#include "vektor/thread_pool.h"
+#include "vektor/tracer.h"
 
 namespace Vektor {
 
+// T is the pixel type, or Image::PlanarRGBImage for a planar RGB image.
 template <typename T>
 class ImageWithBytes {
-  using Image_t = Image::Image<T>;
+  using Image_t = std::conditional_t<
+    std::same_as<T, bool>,
+    Image::BinaryImage,
+    std::conditional_t<
+      std::same_as<T, Image::Gradient>,
+      Image::GradientImage,
+      std::conditional_t<std::same_as<T, Image::PlanarRGBImage>, T, Image::Image<T>>>>;
 
 public:
   ImageWithBytes() = default;
-  ImageWithBytes(const Image_t& image) : m_bytes(image_to_bytes(image)), m_image(image) {}
-  ImageWithBytes(Image_t&& image) : m_bytes(image_to_bytes(image)), m_image(std::move(image)) {}
+  ImageWithBytes(const Image_t& image, bool materialize_bytes = true)
+      : m_image(image), m_materialize_bytes { materialize_bytes } {}
+  ImageWithBytes(Image_t&& image, bool materialize_bytes = true)
+      : m_image(std::move(image)), m_materialize_bytes { materialize_bytes } {}
+
+  ImageWithBytes(const ImageWithBytes& other)
+      : m_image(other.m_image), m_materialize_bytes { other.m_materialize_bytes } {}
+  ImageWithBytes(ImageWithBytes&& other) noexcept
+      : m_image(std::move(other.m_image)),
+        m_materialize_bytes { other.m_materialize_bytes },
+        m_bytes(std::move(other.m_bytes)) {}
+
+  ImageWithBytes& operator=(const ImageWithBytes& other) {
+    return *this = ImageWithBytes { other };
+  }
+
+  ImageWithBytes& operator=(ImageWithBytes&& other) noexcept {
+    m_image = std::move(other.m_image);
+    m_materialize_bytes = other.m_materialize_bytes;
+    m_bytes = std::move(other.m_bytes);
+    return *this;
+  }
 
   int width() const noexcept {
     return m_image.width();
@@ -29,25 +72,39 @@ public:
   }
 
   bool empty() const noexcept {
-    return m_bytes.empty();
+    return m_image.width() == 0 || m_image.height() == 0;
   }
 
   const Image_t& image() const noexcept {
     return m_image;
   }
 
-  const std::vector<std::byte>& bytes() const noexcept {
+  // RGBA bytes of the image, converted on first use and kept until the image is replaced. Always
+  // empty if the bytes were opted out of at construction.
+  const std::vector<std::byte>& bytes() const {
+    std::lock_guard lock { m_bytes_mutex };
+    if (m_bytes.empty() && m_materialize_bytes && !empty()) {
+      m_bytes = image_to_bytes(m_image);
+    }
     return m_bytes;
   }
 
+  // The number of RGBA bytes converted so far, without converting them.
+  std::size_t nr_materialized_bytes() const {
+    std::lock_guard lock { m_bytes_mutex };
+    return m_bytes.size();
+  }
+
   void clear() noexcept {
     m_image.clear();
     m_bytes.clear();
   }
 
 private:
-  std::vector<std::byte> m_bytes;
   Image_t m_image;
+  bool m_materialize_bytes = true;
+  mutable std::mutex m_bytes_mutex;
+  mutable std::vector<std::byte> m_bytes;
 
   static auto image_to_bytes(const Image_t& image) {
     const int width = image.width();
@@ -64,16 +121,16 @@ private:
         auto value = static_cast<std::byte>(glm::clamp(image[x, y] * SCALE_FACTOR, 0.0f, CLAMP));
         data[NC * index] = data[NC * index + 1] = data[NC * index + 2] = value;
 
-      } else if constexpr (std::same_as<T, std::pair<float, float>>) {
-        auto value =
-          static_cast<std::byte>(glm::clamp(image[x, y].first * SCALE_FACTOR, 0.0f, CLAMP));
+      } else if constexpr (std::same_as<T, Image::Gradient>) {
+        float magnitude = image[x, y].magnitude() / image.max_magnitude;
+        auto value = static_cast<std::byte>(glm::clamp(magnitude * SCALE_FACTOR, 0.0f, CLAMP));
         data[NC * index] = data[NC * index + 1] = data[NC * index + 2] = value;
 
-      } else if constexpr (std::same_as<T, char>) {
+      } else if constexpr (std::same_as<T, bool>) {
         auto value = static_cast<std::byte>(image[x, y] ? 255 : 0);
         data[NC * index] = data[NC * index + 1] = data[NC * index + 2] = value;
 
-      } else if constexpr (std::same_as<T, glm::vec3>) {
+      } else if constexpr (std::same_as<T, glm::vec3> || std::same_as<T, Image::PlanarRGBImage>) {
         glm::vec3 color = glm::clamp(image[x, y] * SCALE_FACTOR, 0.0f, CLAMP);
         data[NC * index + 0] = static_cast<std::byte>(color.r);
         data[NC * index + 1] = static_cast<std::byte>(color.g);
@@ -96,11 +153,44 @@ private:
   }
 };
 
-using RawRGBAImage = ImageWithBytes<glm::vec4>;
+// 8-bit RGBA pixels, row by row, exactly as they were handed to the pipeline.
+class RawRGBAImage {
+public:
+  RawRGBAImage() = default;
+  RawRGBAImage(std::vector<std::byte>&& bytes, int width, int height)
+      : m_bytes(std::move(bytes)), m_width { width }, m_height { height } {}
+
+  int width() const noexcept {
+    return m_width;
+  }
+
+  int height() const noexcept {
+    return m_height;
+  }
+
+  bool empty() const noexcept {
+    return m_width == 0 || m_height == 0;
+  }
+
+  const std::vector<std::byte>& bytes() const noexcept {
+    return m_bytes;
+  }
+
+  void clear() noexcept {
+    m_bytes.clear();
+    m_width = m_height = 0;
+  }
+
+private:
+  std::vector<std::byte> m_bytes;
+  int m_width = 0, m_height = 0;
+};
+
 using RawRGBImage = ImageWithBytes<glm::vec3>;
-using RawGradientImage = ImageWithBytes<std::pair<float, float>>;
+using RawPlanarRGBImage = ImageWithBytes<Image::PlanarRGBImage>;
+using RawGradientImage = ImageWithBytes<Image::Gradient>;
 using RawGreyscaleImage = ImageWithBytes<float>;
-using RawBinaryImage = ImageWithBytes<char>;
+using RawBinaryImage = ImageWithBytes<bool>;
 
 struct PipelineConfig {
   enum class BackgroundColor { black, white };
@@ -123,75 +213,140 @@ struct PipelineConfig {
   };
 };
 
+// Stage results are shared, immutable snapshots: copying a stage is cheap, and a result stays
+// valid for as long as someone holds it, even after the stage has moved on.
+template <typename T>
+using Shared = std::shared_ptr<const T>;
+
+// Each stage keeps the fingerprint of its result. A stage whose key differs from it looks the key
+// up in the StageCache and only computes the result on a miss, so revisiting an earlier config
+// reuses every stage it shares with that config.
 class BlurStage {
 public:
-  RawRGBImage result;
-
-  bool update(const RawRGBImage&, const PipelineConfig&, bool);
+  Shared<RawPlanarRGBImage> result = std::make_shared<const RawPlanarRGBImage>();
+  Fingerprint fingerprint = 0;
+  bool materialize_bytes = true;
 
-private:
-  int m_kernel_size = 0;
-  int m_nr_iterations = 0;
+  void update(const RawPlanarRGBImage&, Fingerprint, const PipelineConfig&, StageCache&);
 };
 
 class GradientStage {
 public:
-  RawGradientImage result;
+  Shared<RawGradientImage> result = std::make_shared<const RawGradientImage>();
+  Fingerprint fingerprint = 0;
+  bool materialize_bytes = true;
 
-  bool update(const RawRGBImage&, bool);
+  void update(const RawPlanarRGBImage&, Fingerprint, StageCache&);
 };
 
+// The later stages work on the edge pixels; the thinned image is only built from them for display.
 class ThinningStage {
 public:
-  RawGreyscaleImage result;
+  Shared<Canny::EdgePixels> edges = std::make_shared<const Canny::EdgePixels>();
+  Shared<RawGreyscaleImage> result = std::make_shared<const RawGreyscaleImage>();
+  Fingerprint fingerprint = 0;
+  bool materialize_bytes = true;
 
-  bool update(const RawGradientImage&, bool);
+  void update(const RawGradientImage&, Fingerprint, StageCache&);
 };
 
 class ThresholdStage {
 public:
   float tl = 0.0f;
   float th = 0.0f;
+  Fingerprint fingerprint = 0;
 
-  bool update(const RawGreyscaleImage&, bool);
+  void update(const Canny::EdgePixels&, Fingerprint, StageCache&);
 };
 
+// Keeps the labelled weak components, so that a change of take_percentile alone only paints or
+// clears the components between the old and the new cut, on a copy of the previous mask.
 class HysteresisStage {
 public:
-  RawBinaryImage result;
-
-  bool update(const RawGreyscaleImage&, float, float, const PipelineConfig&, bool);
+  Shared<RawBinaryImage> result = std::make_shared<const RawBinaryImage>();
+  Fingerprint fingerprint = 0;
+  bool materialize_bytes = true;
+
+  Shared<Canny::WeakComponents> components = std::make_shared<const Canny::WeakComponents>();
+  Fingerprint components_fingerprint = 0;
+
+  void update(
+    const Canny::EdgePixels&,
+    float,
+    float,
+    Fingerprint,
+    const PipelineConfig&,
+    StageCache&
+  );
 
 private:
-  float m_take_percentile = -1.0f;
+  // What the current result was computed from.
+  Fingerprint m_threshold_fingerprint = 0;
+  float m_take_percentile = 0.0f;
 };
 
+// Traces the components hysteresis keeps straight from their pixel lists, one by one, and keeps
+// the curves and colours of the last trace, so that only the components a hysteresis change
+// touched are traced and coloured again. The hysteresis image is only built for display.
 class TracingStage {
 public:
-  std::vector<BezierCurveWithColor> curves;
+  Shared<std::vector<BezierCurveWithColor>> curves =
+    std::make_shared<const std::vector<BezierCurveWithColor>>();
+  Fingerprint fingerprint = 0;
+
+  // The curve colours come from the source image, so its fingerprint is part of the key.
+  void update(
+    const Canny::WeakComponents&,
+    float,
+    const RawPlanarRGBImage&,
+    Fingerprint,
+    Fingerprint,
+    Renderer::FlattenCache&,
+    StageCache&
+  );
+
+private:
+  struct Components {
+    std::vector<Tracer::ComponentCurves> components;
+    // The colours of components[c].curves, taken from the source image with this fingerprint.
+    std::vector<std::vector<glm::vec3>> colors;
+    Fingerprint source_fingerprint = 0;
+  };
 
-  bool update(const RawBinaryImage&, const RawRGBImage&, bool);
+  Shared<Components> m_components = std::make_shared<const Components>();
 };
 
 class PlottingStage {
 public:
-  RawGreyscaleImage greyscale_plot;
-  RawRGBImage color_plot;
-
-  bool
-  update(const std::vector<BezierCurveWithColor>&, const RawRGBImage&, const PipelineConfig&, bool);
-
-private:
-  float m_plot_scale = 0.0f;
-  PipelineConfig::BackgroundColor m_background_color = PipelineConfig::BackgroundColor::black;
+  Shared<RawGreyscaleImage> greyscale_plot = std::make_shared<const RawGreyscaleImage>();
+  Shared<RawRGBImage> color_plot = std::make_shared<const RawRGBImage>();
+  Fingerprint fingerprint = 0;
+  bool materialize_bytes = true;
+
+  void update(
+    const std::vector<BezierCurveWithColor>&,
+    const RawPlanarRGBImage&,
+    Fingerprint,
+    const PipelineConfig&,
+    Renderer::FlattenCache&,
+    StageCache&
+  );
 };
 
 class Pipeline {
 public:
   using Config = PipelineConfig;
 
+  // Without materialize_bytes, the RGBA bytes of the stage images are never produced, for callers
+  // that only want the images or the curves.
+  explicit Pipeline(bool materialize_bytes = true);
+  ~Pipeline();
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
   const RawRGBAImage& source_image() const noexcept;
-  const RawRGBImage& blurred_image() const noexcept;
+  const RawPlanarRGBImage& blurred_image() const noexcept;
   const RawGradientImage& gradient_image() const noexcept;
   const RawGreyscaleImage& thinned_image() const noexcept;
   const RawBinaryImage& hysteresis_image() const noexcept;
@@ -199,38 +354,85 @@ public:
   const RawRGBImage& color_plot() const noexcept;
   const std::vector<BezierCurveWithColor>& curves() const noexcept;
 
-  template <typename T>
-    requires std::same_as<std::remove_cvref_t<T>, Image::RGBAImage>
-  void set_source_image(T&& img) {
-    Image::RGBImage rgb_image { img.width(), img.height() };
-    Image::apply(img.width(), img.height(), [&](int x, int y) {
-      glm::vec4 color = img[x, y];
-      rgb_image[x, y] = glm::vec3(color.r, color.g, color.b);
-    });
+  // Takes 8-bit RGBA pixels, row by row. They are converted once, straight into the padded channel
+  // planes the blur reads. The source view is served from the bytes themselves; a borrowed span is
+  // only copied for it when the stage bytes are materialized.
+  void set_source_image(std::vector<std::byte>&&, int, int);
+  void set_source_image(std::span<const std::byte>, int, int);
+  void set_source_image(const Image::RGBAImage&);
 
-    m_source_image_rgba = std::forward<T>(img);
-    m_source_image_rgb = std::move(rgb_image);
+  // Runs the pipeline to completion on the calling thread, superseding any asynchronous run: the
+  // one in flight is cancelled, and the error of one that failed is dropped.
+  void set_config(Config);
 
-    run_pipeline(true);
-  }
+  // Starts a run with the given config on the pipeline's worker thread and returns at once. A
+  // newer request cancels the run in flight. The results become visible through poll().
+  void set_config_async(Config);
 
-  void set_config(Config);
+  // Makes the results of the latest completed asynchronous run visible, all at once. Returns
+  // whether anything changed. References returned by the accessors are invalidated when it
+  // returns true.
+  bool poll();
+
+  // The config of the visible results.
   Config config() const noexcept;
 
+  // Bytes of stage results kept for reuse across configs; defaults to
+  // StageCache::default_budget.
+  void set_cache_budget(std::size_t);
+
+  // Off by default. While on, every run records the time of each stage and what it counted; the
+  // profile of the visible results is returned by profile().
+  void set_profiling(bool) noexcept;
+  const Profiler::Profile& profile() const noexcept;
+
 private:
-  Config m_config = Config::Default();
-  RawRGBAImage m_source_image_rgba;
-  RawRGBImage m_source_image_rgb;
-
-  BlurStage m_blur;
-  GradientStage m_gradient;
-  ThinningStage m_thinning;
-  ThresholdStage m_threshold;
-  HysteresisStage m_hysteresis;
-  TracingStage m_tracing;
-  PlottingStage m_plotting;
-
-  void run_pipeline(bool);
+  struct State {
+    Config config = Config::Default();
+    Shared<RawRGBAImage> source_image_rgba = std::make_shared<const RawRGBAImage>();
+    Shared<RawPlanarRGBImage> source_image_rgb = std::make_shared<const RawPlanarRGBImage>();
+    Fingerprint source_fingerprint = 0;
+
+    BlurStage blur;
+    GradientStage gradient;
+    ThinningStage thinning;
+    ThresholdStage threshold;
+    HysteresisStage hysteresis;
+    TracingStage tracing;
+    PlottingStage plotting;
+
+    Profiler::Profile profile;
+  };
+
+  bool m_materialize_bytes;
+  std::atomic<bool> m_profiling = false;
+
+  // Read by the accessors; only touched by the owning thread.
+  State m_state;
+
+  // Used by whichever run is in progress; only one run uses them at a time.
+  Renderer::FlattenCache m_flatten_cache;
+  StageCache m_stage_cache;
+
+  // The latest completed state, which runs start from, and the pending asynchronous request.
+  std::mutex m_mutex;
+  std::condition_variable_any m_wake;
+  std::condition_variable m_idle;
+  State m_completed;
+  bool m_has_update = false;
+  std::exception_ptr m_error;
+  std::optional<Config> m_request;
+  std::stop_source m_run_stop;
+  bool m_running = false;
+#if VEKTOR_HAS_THREADS
+  std::jthread m_worker;
+#endif
+
+  void set_source(RawRGBAImage&&, RawPlanarRGBImage&&);
+  void cancel_async_run();
+  void supersede_async_run();
+  void worker_loop(std::stop_token);
+  void run_pipeline(State&);
 };
 
 }  // namespace Vektor
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+
+namespace Vektor {
+
+// Identifies a stage result by everything it was computed from: the fingerprint of its input
+// chained with the stage's own parameters.
+using Fingerprint = std::uint64_t;
+
+inline Fingerprint combine(Fingerprint seed, std::uint64_t value) noexcept {
+  // splitmix64 finalizer over the running state.
+  std::uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Chains the bit patterns of the values onto the seed.
+template <typename... Ts>
+Fingerprint chain(Fingerprint seed, Ts... values) noexcept {
+  auto bits = [](auto value) -> std::uint64_t {
+    if constexpr (std::is_enum_v<decltype(value)>) {
+      return static_cast<std::uint64_t>(std::to_underlying(value));
+    } else if constexpr (std::is_same_v<decltype(value), float>) {
+      return std::bit_cast<std::uint32_t>(value);
+    } else {
+      return static_cast<std::uint64_t>(value);
+    }
+  };
+  ((seed = combine(seed, bits(values))), ...);
+  return seed;
+}
+
+// Least recently used results of the pipeline stages, keyed by fingerprint, holding at most
+// `budget` bytes. A result larger than the whole budget is not kept.
+class StageCache {
+public:
+  static constexpr std::size_t default_budget = std::size_t { 256 } << 20;
+
+  explicit StageCache(std::size_t budget = default_budget) : m_budget { budget } {}
+
+  // The cached result for the key, or null if there is none or it isn't a T. Every stage mixes its
+  // own tag into its fingerprints, so a result of another type would take a colliding key.
+  template <typename T>
+  std::shared_ptr<const T> find(Fingerprint key) {
+    auto it = m_index.find(key);
+    if (it == m_index.end() || it->second->type != typeid(T)) return nullptr;
+
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return std::static_pointer_cast<const T>(it->second->value);
+  }
+
+  template <typename T>
+  void insert(Fingerprint key, std::shared_ptr<const T> value, std::size_t bytes) {
+    if (auto it = m_index.find(key); it != m_index.end()) {
+      m_bytes -= it->second->bytes;
+      m_entries.erase(it->second);
+      m_index.erase(it);
+    }
+    if (bytes > m_budget) return;
+
+    m_entries.push_front({ key, typeid(T), std::move(value), bytes });
+    m_index[key] = m_entries.begin();
+    m_bytes += bytes;
+    evict();
+  }
+
+  void set_budget(std::size_t budget) {
+    m_budget = budget;
+    evict();
+  }
+
+  std::size_t budget() const noexcept {
+    return m_budget;
+  }
+
+  void clear() noexcept {
+    m_entries.clear();
+    m_index.clear();
+    m_bytes = 0;
+  }
+
+private:
+  struct Entry {
+    Fingerprint key;
+    std::type_index type;
+    std::shared_ptr<const void> value;
+    std::size_t bytes;
+  };
+
+  std::size_t m_budget;
+  std::size_t m_bytes = 0;
+
+  // Most recently used first.
+  std::list<Entry> m_entries;
+  std::unordered_map<Fingerprint, std::list<Entry>::iterator> m_index;
+
+  void evict() {
+    while (m_bytes > m_budget) {
+      m_bytes -= m_entries.back().bytes;
+      m_index.erase(m_entries.back().key);
+      m_entries.pop_back();
+    }
+  }
+};
+
+}  // namespace Vektor
@@ -0,0 +1,136 @@
+#pragma once
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Image {
+
+// One bit per pixel, 64 pixels to a word. Every row, padding included, starts on a word of its
+// own, so different rows can be written from different threads, and a row's neighbourhood can be
+// read a word at a time. Pixel x of a row is bit (x + padding) % 64 of its word (x + padding) / 64.
+class BinaryImage {
+public:
+  using Word = std::uint64_t;
+  static constexpr int WORD_BITS = 64;
+
+  class Reference {
+  public:
+    Reference& operator=(bool value) noexcept {
+      if (value) {
+        *m_word |= m_mask;
+      } else {
+        *m_word &= ~m_mask;
+      }
+      return *this;
+    }
+
+    Reference& operator=(const Reference& other) noexcept {
+      return *this = static_cast<bool>(other);
+    }
+
+    operator bool() const noexcept {
+      return (*m_word & m_mask) != 0;
+    }
+
+  private:
+    friend class BinaryImage;
+    Reference(Word* word, Word mask) noexcept : m_word { word }, m_mask { mask } {}
+
+    Word* m_word;
+    Word m_mask;
+  };
+
+  BinaryImage(int width = 0, int height = 0, int padding = 0)
+      : m_width { width },
+        m_height { height },
+        m_padding { padding },
+        m_words_per_row { (width + 2 * padding + WORD_BITS - 1) / WORD_BITS },
+        m_data(static_cast<std::size_t>(m_words_per_row) * (height + 2 * padding)) {}
+
+  BinaryImage(const BinaryImage& image, int padding)
+      : BinaryImage { image.width(), image.height(), padding } {
+    for (int y = 0; y < m_height; ++y) {
+      for (int x = 0; x < m_width; ++x) {
+        (*this)[x, y] = image[x, y];
+      }
+    }
+  }
+
+  bool operator[](int x, int y) const noexcept {
+    const int bit = x + m_padding;
+    return (row(y)[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+  }
+
+  Reference operator[](int x, int y) noexcept {
+    const int bit = x + m_padding;
+    return { row(y) + bit / WORD_BITS, Word { 1 } << (bit % WORD_BITS) };
+  }
+
+  // Pixels x up to x + n of row y in the low n bits, pixel x lowest; n is at most 32 and the
+  // pixels must lie within the padded row.
+  Word bits(int x, int y, int n) const noexcept {
+    const int bit = x + m_padding;
+    const int shift = bit % WORD_BITS;
+    const Word* words = row(y) + bit / WORD_BITS;
+
+    Word value = words[0] >> shift;
+    if (shift + n > WORD_BITS) value |= words[1] << (WORD_BITS - shift);
+    return value & ((Word { 1 } << n) - 1);
+  }
+
+  // The words of row y, padding included.
+  const Word* row(int y) const noexcept {
+    return m_data.data() + static_cast<std::size_t>(y + m_padding) * m_words_per_row;
+  }
+
+  Word* row(int y) noexcept {
+    return m_data.data() + static_cast<std::size_t>(y + m_padding) * m_words_per_row;
+  }
+
+  int words_per_row() const noexcept {
+    return m_words_per_row;
+  }
+
+  auto data() const noexcept -> const std::vector<Word>& {
+    return m_data;
+  }
+
+  // Calls f(x, y) for every set pixel of the image proper, in raster order.
+  void for_each_set(auto&& f) const {
+    for (int y = 0; y < m_height; ++y) {
+      const Word* words = row(y);
+      for (int k = 0; k < m_words_per_row; ++k) {
+        for (Word word = words[k]; word != 0; word &= word - 1) {
+          const int x = k * WORD_BITS + std::countr_zero(word) - m_padding;
+          if (x >= 0 && x < m_width) f(x, y);
+        }
+      }
+    }
+  }
+
+  int width() const noexcept {
+    return m_width;
+  }
+
+  int height() const noexcept {
+    return m_height;
+  }
+
+  int padding() const noexcept {
+    return m_padding;
+  }
+
+  void clear() noexcept {
+    m_width = m_height = m_padding = m_words_per_row = 0;
+    m_data.clear();
+  }
+
+private:
+  int m_width, m_height;
+  int m_padding;
+  int m_words_per_row;
+  std::vector<Word> m_data;
+};
+
+}  // namespace Image
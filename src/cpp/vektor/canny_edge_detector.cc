@@ -1,41 +1,37 @@
 #include "canny_edge_detector.h"
 
 #include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <functional>
 #include <glm/glm.hpp>
-#include <numbers>
+#include <numeric>
 #include <ranges>
-#include <stack>
+#include <utility>
 
+#include "gradient_kernel.h"
 #include "image.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include "tiling.h"
 
 using Image::BinaryImage;
+using Image::Gradient;
 using Image::GradientImage;
 using Image::GreyscaleImage;
+using Image::PlanarRGBImage;
 using Image::RGBImage;
-constexpr auto pi = std::numbers::pi_v<float>;
 
-namespace Canny {
-
-RGBImage apply_adaptive_blur(const RGBImage& image, float h, int kernel_size, int nr_iterations) {
-  int width = image.width();
-  int height = image.height();
-
-  const int padding = std::max(kernel_size, Canny::gradient_x_kernel.size() / 2);
-  RGBImage result { image, padding };
-  for (int iter = 0; iter < nr_iterations; ++iter) {
-    RGBImage source = std::move(result);
-    result = RGBImage { width, height, padding };
-
-    GreyscaleImage weights { width, height, padding };
-    Image::apply(width, height, [&](int x, int y) {
-      auto gx = Image::evaluate_kernel<glm::vec3>(Canny::gradient_x_kernel, source, x, y);
-      auto gy = Image::evaluate_kernel<glm::vec3>(Canny::gradient_y_kernel, source, x, y);
-      float g2 = glm::dot(gx, gx) + glm::dot(gy, gy);
-      float w = std::exp(-std::sqrt(std::sqrt(g2)) / (2.0f * h * h));
-      weights[x, y] = w;
-    });
-
-    Image::apply(width, height, [&](int x, int y) {
+template <typename RGB>
+void blur_direct(
+  const RGB& source,
+  const GreyscaleImage& weights,
+  int kernel_size,
+  RGB& result,
+  Image::Tile tile
+) {
+  for (int y = tile.y_begin; y < tile.y_end; ++y) {
+    for (int x = 0; x < source.width(); ++x) {
       float weight_sum = 0.0f;
       for (int j = -kernel_size; j <= kernel_size; ++j) {
         for (int i = -kernel_size; i <= kernel_size; ++i) {
@@ -45,89 +41,460 @@ RGBImage apply_adaptive_blur(const RGBImage& image, float h, int kernel_size, in
         }
       }
       result[x, y] /= weight_sum;
+    }
+  }
+}
+
+// The same gather a row at a time: each kernel offset is added to the whole row, channel plane by
+// channel plane, so every pixel still sums its window in the same order.
+void blur_direct(
+  const PlanarRGBImage& source,
+  const GreyscaleImage& weights,
+  int kernel_size,
+  PlanarRGBImage& result,
+  Image::Tile tile
+) {
+  const int width = source.width();
+  std::vector<float> weight_sums(width);
+  for (int y = tile.y_begin; y < tile.y_end; ++y) {
+    std::ranges::fill(weight_sums, 0.0f);
+    for (int j = -kernel_size; j <= kernel_size; ++j) {
+      for (int i = -kernel_size; i <= kernel_size; ++i) {
+        const float* w = &weights[i, y + j];
+        for (int x = 0; x < width; ++x) {
+          weight_sums[x] += w[x];
+        }
+        for (int c = 0; c < PlanarRGBImage::NR_CHANNELS; ++c) {
+          const float* in = source.row(c, y + j) + i;
+          float* out = result.row(c, y);
+          for (int x = 0; x < width; ++x) {
+            out[x] += in[x] * w[x];
+          }
+        }
+      }
+    }
+
+    for (int c = 0; c < PlanarRGBImage::NR_CHANNELS; ++c) {
+      float* out = result.row(c, y);
+      for (int x = 0; x < width; ++x) {
+        out[x] /= weight_sums[x];
+      }
+    }
+  }
+}
+
+// rgb holds the sum of w * src, w the sum of w, for columns [x_begin, x_end) of row y.
+template <typename RGB>
+void accumulate_column_sums(
+  const RGB& source,
+  const GreyscaleImage& weights,
+  int y,
+  double sign,
+  int x_begin,
+  int x_end,
+  std::vector<glm::dvec4>& column_sums
+) {
+  for (int x = x_begin; x < x_end; ++x) {
+    double w = weights[x, y];
+    column_sums[x] += glm::dvec4(glm::dvec3(source[x, y]) * w, w) * sign;
+  }
+}
+
+void accumulate_column_sums(
+  const PlanarRGBImage& source,
+  const GreyscaleImage& weights,
+  int y,
+  double sign,
+  int x_begin,
+  int x_end,
+  std::vector<glm::dvec4>& column_sums
+) {
+  const float* r = source.row(0, y);
+  const float* g = source.row(1, y);
+  const float* b = source.row(2, y);
+  for (int x = x_begin; x < x_end; ++x) {
+    double w = weights[x, y];
+    column_sums[x] += glm::dvec4(r[x] * w, g[x] * w, b[x] * w, w) * sign;
+  }
+}
+
+// The column sums the summed-area blur holds when it reaches the first row of each tile, built
+// with the same additions in the same order as a single pass over the whole image would make, so
+// the result doesn't depend on where the tiles are cut. Columns are independent, so blocks of
+// them run in parallel.
+template <typename RGB>
+auto summed_area_column_sums(
+  const RGB& source,
+  const GreyscaleImage& weights,
+  int kernel_size,
+  const std::vector<Image::Tile>& tiles
+) -> std::vector<std::vector<glm::dvec4>> {
+  constexpr int BLOCK_COLUMNS = 256;
+  const int width = source.width();
+  const int height = source.height();
+
+  std::vector<std::vector<glm::dvec4>> tile_sums(tiles.size(), std::vector<glm::dvec4>(width));
+  const int nr_blocks = (width + BLOCK_COLUMNS - 1) / BLOCK_COLUMNS;
+  Parallel::for_each_index(nr_blocks, [&](int block) {
+    const int x_begin = block * BLOCK_COLUMNS;
+    const int x_end = std::min(x_begin + BLOCK_COLUMNS, width);
+
+    std::vector<glm::dvec4> column_sums(width);
+    for (int y = 0; y < std::min(kernel_size, height); ++y) {
+      accumulate_column_sums(source, weights, y, 1.0, x_begin, x_end, column_sums);
+    }
+
+    int y = 0;
+    for (std::size_t t = 0; t < tiles.size(); ++t) {
+      for (; y < tiles[t].y_begin; ++y) {
+        if (y + kernel_size < height) {
+          accumulate_column_sums(
+            source, weights, y + kernel_size, 1.0, x_begin, x_end, column_sums
+          );
+        }
+        if (y - kernel_size - 1 >= 0) {
+          accumulate_column_sums(
+            source, weights, y - kernel_size - 1, -1.0, x_begin, x_end, column_sums
+          );
+        }
+      }
+      std::copy(
+        column_sums.begin() + x_begin,
+        column_sums.begin() + x_end,
+        tile_sums[t].begin() + x_begin
+      );
+    }
+  });
+
+  return tile_sums;
+}
+
+// Pixels outside the image have zero weight, so clipping the window to the image gives the same
+// sums as the padded gather. column_sums holds the sums for the tile's first row, as
+// summed_area_column_sums computes them.
+template <typename RGB>
+void blur_summed_area(
+  const RGB& source,
+  const GreyscaleImage& weights,
+  int kernel_size,
+  RGB& result,
+  Image::Tile tile,
+  std::vector<glm::dvec4> column_sums
+) {
+  int width = source.width();
+  int height = source.height();
+
+  std::vector<glm::dvec4> row_prefix(width + 1);
+  for (int y = tile.y_begin; y < tile.y_end; ++y) {
+    if (y + kernel_size < height) {
+      accumulate_column_sums(source, weights, y + kernel_size, 1.0, 0, width, column_sums);
+    }
+    if (y - kernel_size - 1 >= 0) {
+      accumulate_column_sums(source, weights, y - kernel_size - 1, -1.0, 0, width, column_sums);
+    }
+
+    for (int x = 0; x < width; ++x) {
+      row_prefix[x + 1] = row_prefix[x] + column_sums[x];
+    }
+
+    auto window_sum = [&](int x) {
+      int x0 = std::max(x - kernel_size, 0);
+      int x1 = std::min(x + kernel_size, width - 1);
+      return row_prefix[x1 + 1] - row_prefix[x0];
+    };
+    if constexpr (std::same_as<RGB, PlanarRGBImage>) {
+      float* r = result.row(0, y);
+      float* g = result.row(1, y);
+      float* b = result.row(2, y);
+      for (int x = 0; x < width; ++x) {
+        glm::dvec4 sum = window_sum(x);
+        r[x] = static_cast<float>(sum.r / sum.w);
+        g[x] = static_cast<float>(sum.g / sum.w);
+        b[x] = static_cast<float>(sum.b / sum.w);
+      }
+    } else {
+      for (int x = 0; x < width; ++x) {
+        glm::dvec4 sum = window_sum(x);
+        result[x, y] = glm::vec3(glm::dvec3(sum) / sum.w);
+      }
+    }
+  }
+}
+
+template <typename RGB>
+RGB adaptive_blur_iteration(const RGB& image, float h, int kernel_size, Canny::BlurMethod method) {
+  int width = image.width();
+  int height = image.height();
+
+  // The weights read the structure tensor's window around every pixel and the direct gather
+  // reads the whole kernel window; the summed-area pass never reads outside the image.
+  const int padding = std::max(kernel_size, Canny::padding_requirement);
+  const int input_padding =
+    method == Canny::BlurMethod::direct ? padding : Canny::padding_requirement;
+  if (image.padding() < input_padding) {
+    return adaptive_blur_iteration(RGB { image, padding }, h, kernel_size, method);
+  }
+  Profiler::count(Profiler::Counter::pixels, static_cast<std::int64_t>(width) * height);
+
+  RGB result { width, height, padding };
+
+  GreyscaleImage weights { width, height, padding };
+  auto weight_row = [&](int y, const Canny::StructureTensorRow& row) {
+    for (int x = 0; x < width; ++x) {
+      float g2 = row.a[x] + row.c[x];
+      float w = std::exp(-std::sqrt(std::sqrt(g2)) / (2.0f * h * h));
+      weights[x, y] = w;
+    }
+  };
+  Image::for_each_tile(width, height, Canny::padding_requirement, [&](Image::Tile tile) {
+    Canny::for_each_structure_tensor_row(image, tile.y_begin, tile.y_end, weight_row);
+  });
+
+  auto tiles = Image::make_tiles(width, height, kernel_size);
+  if (method == Canny::BlurMethod::direct) {
+    Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int t) {
+      blur_direct(image, weights, kernel_size, result, tiles[t]);
+    });
+  } else {
+    auto column_sums = summed_area_column_sums(image, weights, kernel_size, tiles);
+    Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int t) {
+      blur_summed_area(image, weights, kernel_size, result, tiles[t], std::move(column_sums[t]));
     });
   }
 
   return result;
 }
 
-GradientImage compute_gradient(const RGBImage& image) {
+template <typename RGB>
+RGB adaptive_blur(
+  const RGB& image,
+  float h,
+  int kernel_size,
+  int nr_iterations,
+  Canny::BlurMethod method
+) {
+  const int padding = std::max(kernel_size, Canny::padding_requirement);
+  RGB result { image, padding };
+  for (int iter = 0; iter < nr_iterations; ++iter) {
+    result = adaptive_blur_iteration(result, h, kernel_size, method);
+  }
+
+  return result;
+}
+
+// The bucket of the orientation theta = atan2(2b, a - c) / 2 of the structure tensor
+// [a b; b c], found by comparing the terms rather than taking the arctangent: with
+// u = a - c and v = 2b, the buckets split 2 theta at 45, 135, 245 and 315 degrees.
+Gradient::Direction gradient_direction(float a, float b, float c) noexcept {
+  constexpr float eps = 1e-12f;
+  // tan(65 degrees); thinning has always split the vertical and anti-diagonal buckets at 122.5.
+  constexpr float tan_65 = 2.14450692f;
+
+  float u = a - c + eps;
+  float v = 2.0f * b;
+  if (u > 0.0f && glm::abs(v) <= u) return Gradient::Direction::horizontal;
+  if (v > glm::abs(u)) return Gradient::Direction::diagonal;
+  if (u < 0.0f && v <= -u && v > tan_65 * u) return Gradient::Direction::vertical;
+  return Gradient::Direction::anti_diagonal;
+}
+
+// The histogram bin of a normalized magnitude; bin 0 is always empty.
+int bin_of(float magnitude, int nr_bins) noexcept {
+  return std::min(nr_bins, 1 + static_cast<int>(magnitude * nr_bins));
+}
+
+template <typename RGB>
+GradientImage gradient(const RGB& image) {
   int width = image.width();
   int height = image.height();
+  Profiler::count(Profiler::Counter::pixels, static_cast<std::int64_t>(width) * height);
   GradientImage result { width, height, 1 };
 
-  float max_magnitude = 0.0f;
+  // Per-row maxima keep the reduction independent of how rows are split across threads.
+  std::vector<float> row_max_magnitude(height);
   const int inset = 1;
-  Image::apply_with_inset(width, height, inset, inset, [&](int x, int y) {
-    auto gx = Image::evaluate_kernel<glm::vec3>(Canny::gradient_x_kernel, image, x, y);
-    auto gy = Image::evaluate_kernel<glm::vec3>(Canny::gradient_y_kernel, image, x, y);
+  auto evaluate_row = [&](int y, const Canny::StructureTensorRow& row) {
+    float& max_magnitude = row_max_magnitude[y];
+    for (int x = inset; x < width - inset; ++x) {
+      float a = row.a[x];
+      float b = row.b[x];
+      float c = row.c[x];
+
+      float trace = a + c;
+      float delta = glm::max(0.0f, (a - c) * (a - c) + 4.0f * b * b);
+      float lambda_max = 0.5f * (trace + glm::sqrt(delta));
+
+      float magnitude = glm::sqrt(lambda_max);
+      max_magnitude = glm::max(max_magnitude, magnitude);
+
+      result.magnitudes[x, y] = magnitude;
+      result.directions[x, y] = gradient_direction(a, b, c);
+    }
+  };
+  Image::for_each_tile(width, height, Canny::padding_requirement, [&](Image::Tile tile) {
+    int y_begin = std::max(tile.y_begin, inset);
+    int y_end = std::min(tile.y_end, height - inset);
+    Canny::for_each_structure_tensor_row(image, y_begin, y_end, evaluate_row);
+  });
 
-    float a = glm::dot(gx, gx);
-    float b = glm::dot(gx, gy);
-    float c = glm::dot(gy, gy);
+  for (float magnitude : row_max_magnitude) {
+    result.max_magnitude = glm::max(result.max_magnitude, magnitude);
+  }
 
-    float trace = a + c;
-    float delta = glm::max(0.0f, (a - c) * (a - c) + 4.0f * b * b);
-    float lambda_max = 0.5f * (trace + glm::sqrt(delta));
+  return result;
+}
 
-    float magnitude = glm::sqrt(lambda_max);
-    max_magnitude = glm::max(max_magnitude, magnitude);
+namespace Canny {
 
-    constexpr float eps = 1e-12f;
-    float angle = 0.5f * glm::atan(2.0f * b, a - c + eps);
-    if (angle < 0.0f) angle += pi;
+RGBImage apply_adaptive_blur(
+  const RGBImage& image,
+  float h,
+  int kernel_size,
+  int nr_iterations,
+  BlurMethod method
+) {
+  return adaptive_blur(image, h, kernel_size, nr_iterations, method);
+}
 
-    result[x, y] = std::make_pair(magnitude, angle);
-  });
+PlanarRGBImage apply_adaptive_blur(
+  const PlanarRGBImage& image,
+  float h,
+  int kernel_size,
+  int nr_iterations,
+  BlurMethod method
+) {
+  return adaptive_blur(image, h, kernel_size, nr_iterations, method);
+}
 
-  Image::apply(width, height, [&](int x, int y) { result[x, y].first /= max_magnitude; });
+RGBImage apply_adaptive_blur_iteration(
+  const RGBImage& image,
+  float h,
+  int kernel_size,
+  BlurMethod method
+) {
+  return adaptive_blur_iteration(image, h, kernel_size, method);
+}
 
-  return result;
+PlanarRGBImage apply_adaptive_blur_iteration(
+  const PlanarRGBImage& image,
+  float h,
+  int kernel_size,
+  BlurMethod method
+) {
+  return adaptive_blur_iteration(image, h, kernel_size, method);
 }
 
-GreyscaleImage thin_edges(const GradientImage& image) {
+GradientImage compute_gradient(const RGBImage& image) {
+  return gradient(image);
+}
+
+GradientImage compute_gradient(const PlanarRGBImage& image) {
+  return gradient(image);
+}
+
+EdgePixels thin_edges(const GradientImage& image) {
   int width = image.width();
   int height = image.height();
-  GreyscaleImage result { width, height, 2 };
-
-  Image::apply(width, height, [&](int x, int y) {
-    float angle = image[x, y].second * 180.0f / pi;
-
-    glm::ivec2 dir;
-    if (angle <= 22.5f || angle >= 157.5f)
-      dir = { 1, 0 };
-    else if (angle < 67.5f)
-      dir = { 1, 1 };
-    else if (angle < 122.5f)
-      dir = { 0, 1 };
-    else
-      dir = { -1, 1 };
-
-    float g0 = image[x, y].first;
-    float g1 = image[x + dir.x, y + dir.y].first;
-    float g2 = image[x - dir.x, y - dir.y].first;
-
-    if (g0 > g1 && g0 > g2) {
-      result[x, y] = g0;
+  Profiler::count(Profiler::Counter::pixels, static_cast<std::int64_t>(width) * height);
+
+  EdgePixels result;
+  result.width = width;
+  result.height = height;
+  result.row_offsets.resize(height + 1);
+
+  // Each tile collects its own pixels, row sizes and histogram, then the tiles are concatenated
+  // in order. The first and last rows are left empty. Magnitudes are normalized as they are kept.
+  struct TilePixels {
+    std::vector<int> xs;
+    std::vector<float> magnitudes;
+    std::vector<int> histogram = std::vector<int>(MAX_BINS + 1);
+  };
+  auto normalize = [&](float magnitude) { return magnitude / image.max_magnitude; };
+
+  auto tiles = Image::make_tiles(width, height, 1);
+  std::vector<TilePixels> tile_pixels(tiles.size());
+  Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int t) {
+    auto& [xs, magnitudes, histogram] = tile_pixels[t];
+    for (int y = std::max(tiles[t].y_begin, 1); y < std::min(tiles[t].y_end, height - 1); ++y) {
+      // The neighbours along each direction, as offsets from the pixel within the padded image.
+      const float* row = &image.magnitudes[0, y];
+      const Gradient::Direction* directions = &image.directions[0, y];
+      const auto stride = &image.magnitudes[0, y + 1] - row;
+      const std::ptrdiff_t offsets[] { 1, stride + 1, stride, stride - 1 };
+
+      const auto row_begin = xs.size();
+      for (int x = 0; x < width; ++x) {
+        auto offset = offsets[std::to_underlying(directions[x])];
+
+        float g0 = row[x];
+        float g1 = row[x + offset];
+        float g2 = row[x - offset];
+
+        if (g0 > g1 && g0 > g2) {
+          // Normalizing can round neighbours together, so the maximum is checked again after.
+          float magnitude = normalize(g0);
+          if (magnitude > normalize(g1) && magnitude > normalize(g2)) {
+            xs.push_back(x);
+            magnitudes.push_back(magnitude);
+            ++histogram[bin_of(magnitude, MAX_BINS)];
+          }
+        }
+      }
+      result.row_offsets[y + 1] = static_cast<int>(xs.size() - row_begin);
     }
   });
 
-  for (int x = 0; x < result.width(); ++x) {
-    result[x, 0] = result[x, result.height() - 1] = 0.0f;
+  std::inclusive_scan(
+    result.row_offsets.begin(), result.row_offsets.end(), result.row_offsets.begin()
+  );
+  result.histogram.resize(MAX_BINS + 1);
+  for (auto& [xs, magnitudes, histogram] : tile_pixels) {
+    result.xs.append_range(xs);
+    result.magnitudes.append_range(magnitudes);
+    std::ranges::transform(result.histogram, histogram, result.histogram.begin(), std::plus<> {});
   }
 
   return result;
 }
 
-// https://www.nature.com/articles/s41598-025-86860-9
-std::pair<float, float> compute_threshold(const GreyscaleImage& image, int nr_bins) {
-  std::vector<int> bins(nr_bins + 1);
-  Image::apply(image.width(), image.height(), [&](int x, int y) {
-    int idx = std::min(nr_bins, 1 + static_cast<int>(image[x, y] * nr_bins));
-    ++bins[idx];
+GreyscaleImage to_image(const EdgePixels& edges) {
+  GreyscaleImage result { edges.width, edges.height, 2 };
+  Image::for_each_tile(edges.width, edges.height, 0, [&](Image::Tile tile) {
+    for (int y = tile.y_begin; y < tile.y_end; ++y) {
+      for (int i = edges.row_offsets[y]; i < edges.row_offsets[y + 1]; ++i) {
+        result[edges.xs[i], y] = edges.magnitudes[i];
+      }
+    }
   });
+  return result;
+}
+
+// https://www.nature.com/articles/s41598-025-86860-9
+std::pair<float, float> compute_threshold(const EdgePixels& edges, int nr_bins) {
+  Profiler::count(Profiler::Counter::pixels, edges.size());
+
+  // Thinning has already binned the edge pixels at the default resolution.
+  std::vector<int> bins = edges.histogram;
+  if (nr_bins != MAX_BINS || bins.empty()) {
+    auto tiles = Image::make_tiles(edges.width, edges.height, 0);
+    std::vector<std::vector<int>> tile_bins(tiles.size(), std::vector<int>(nr_bins + 1));
+    Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int t) {
+      int end = edges.row_offsets[tiles[t].y_end];
+      for (int i = edges.row_offsets[tiles[t].y_begin]; i < end; ++i) {
+        ++tile_bins[t][bin_of(edges.magnitudes[i], nr_bins)];
+      }
+    });
+
+    bins.assign(nr_bins + 1, 0);
+    for (const auto& v : tile_bins) {
+      std::ranges::transform(bins, v, bins.begin(), std::plus<> {});
+    }
+  }
+
+  // Every pixel that isn't an edge pixel is zero, which falls into the first bin.
+  int nr_pixels = edges.width * edges.height;
+  bins[1] += nr_pixels - edges.size();
 
-  int nr_pixels = image.width() * image.height();
   std::vector<std::pair<double, double>> pref_sums(nr_bins + 1);
   for (int i = 1; i <= nr_bins; ++i) {
     auto [sum, sum_i] = pref_sums[i - 1];
@@ -171,96 +538,199 @@ std::pair<float, float> compute_threshold(const GreyscaleImage& image, int nr_bi
   return { best_tl / static_cast<float>(nr_bins), best_th / static_cast<float>(nr_bins) };
 }
 
-BinaryImage
-apply_hysteresis(const GreyscaleImage& image, float low, float high, float take_percentile) {
-  // clang-format off
-  constexpr std::array<std::pair<int, int>, 8> dirs = {{
-     { -1, -1, },
-     {  0, -1, },
-     {  1, -1, },
-     { -1,  0, },
-     {  1,  0, },
-     { -1,  1, },
-     {  0,  1, },
-     {  1,  1, },
-  }};
-  // clang-format on
-
-  int width = image.width();
-  int height = image.height();
-  Image::Image<unsigned char> visited { width, height, image.padding() };
-  auto dfs = [&](int x0, int y0, std::vector<glm::ivec2>& points) {
-    std::stack<glm::ivec2> s;
-    s.push({ x0, y0 });
-
-    bool found_strong_pixel = false;
-
-    while (!s.empty()) {
-      auto p = s.top();
-      s.pop();
-
-      if (visited[p.x, p.y]) continue;
-      visited[p.x, p.y] = true;
-      points.push_back(p);
-
-      for (auto [dx, dy] : dirs) {
-        glm::ivec2 p1 = p + glm::ivec2(dx, dy);
-        float val = image[p1.x, p1.y];
+WeakComponents label_weak_components(const EdgePixels& edges, float low, float high) {
+  const int width = edges.width;
+  const int height = edges.height;
+  const auto& row_offsets = edges.row_offsets;
+  const auto& xs = edges.xs;
+  const auto& magnitudes = edges.magnitudes;
+  Profiler::count(Profiler::Counter::pixels, edges.size());
+
+  // Every pixel at or above low is labelled, strong ones included. A component with a strong
+  // pixel is exactly the strong pixels and the weak components touching them, and one without
+  // is a free weak component. Pixels that aren't edge pixels are never weak, even with low at 0.
+  auto is_candidate = [&](int i) { return magnitudes[i] >= low; };
+
+  // Labels are indices into the edge pixels. Each tile unites its own rows, then the rows on
+  // either side of every tile boundary are united serially. Roots are always the smaller index, so
+  // a component ends up labelled by its first pixel in raster order however the unions were split.
+  std::vector<int> labels(edges.size(), -1);
+  auto find_root = [&](int i) {
+    while (labels[i] != i) {
+      labels[i] = labels[labels[i]];
+      i = labels[i];
+    }
+    return i;
+  };
+  auto unite = [&](int a, int b) {
+    a = find_root(a), b = find_root(b);
+    if (a > b) std::swap(a, b);
+    labels[b] = a;
+  };
+  // Both rows are sorted by x, so the neighbours above are found by walking the rows together.
+  auto unite_with_row_above = [&](int y) {
+    int j = row_offsets[y - 1];
+    const int above_end = row_offsets[y];
+    for (int i = row_offsets[y]; i < row_offsets[y + 1]; ++i) {
+      if (!is_candidate(i)) continue;
+      while (j < above_end && xs[j] < xs[i] - 1) ++j;
+      for (int k = j; k < above_end && xs[k] <= xs[i] + 1; ++k) {
+        if (is_candidate(k)) unite(i, k);
+      }
+    }
+  };
 
-        if (!found_strong_pixel && val >= high) {
-          found_strong_pixel = true;
-        }
+  auto tiles = Image::make_tiles(width, height, 1);
+  Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int t) {
+    for (int y = tiles[t].y_begin; y < tiles[t].y_end; ++y) {
+      for (int i = row_offsets[y]; i < row_offsets[y + 1]; ++i) {
+        if (!is_candidate(i)) continue;
 
-        if (visited[p1.x, p1.y] || val < low || val >= high) continue;
-        s.push({ p1.x, p1.y });
+        labels[i] = i;
+        if (i > row_offsets[y] && xs[i - 1] == xs[i] - 1 && is_candidate(i - 1)) unite(i, i - 1);
       }
+      if (y > tiles[t].y_begin) unite_with_row_above(y);
     }
+  });
 
-    return found_strong_pixel;
-  };
-
-  std::vector<std::vector<glm::ivec2>> weak_pixels;
-  BinaryImage result { width, height, 2 };
-  Image::apply(width, height, [&](int x, int y) {
-    if (visited[x, y]) return;
-    float val = image[x, y];
+  for (const auto& tile : tiles | std::views::drop(1)) {
+    unite_with_row_above(tile.y_begin);
+  }
 
-    if (val >= high) {
-      result[x, y] = 1;
+  // Parents always precede their children, so one raster pass both flattens the forest and
+  // renumbers the roots to 0, 1, 2, ... in order of first appearance.
+  std::vector<int> sizes;
+  std::vector<unsigned char> has_strong;
+  for (int i = 0; i < edges.size(); ++i) {
+    if (labels[i] < 0) continue;
+    if (labels[i] == i) {
+      labels[i] = static_cast<int>(sizes.size());
+      sizes.push_back(0);
+      has_strong.push_back(0);
+    } else {
+      labels[i] = labels[labels[i]];
+    }
+    ++sizes[labels[i]];
+    has_strong[labels[i]] |= magnitudes[i] >= high;
+  }
+  const int nr_components = static_cast<int>(sizes.size());
 
-    } else if (val >= low) {
-      std::vector<glm::ivec2> points;
-      bool strong_pixel_found = dfs(x, y, points);
+  std::vector<int> weak_components;
+  for (int label = 0; label < nr_components; ++label) {
+    if (!has_strong[label]) weak_components.push_back(label);
+  }
+  Profiler::count(
+    Profiler::Counter::strong_components, nr_components - static_cast<int>(weak_components.size())
+  );
+  std::ranges::stable_sort(weak_components, std::greater<> {}, [&](int label) {
+    return sizes[label];
+  });
 
-      if (strong_pixel_found) {
-        for (auto p : points) {
-          result[p.x, p.y] = 1;
-        }
-      } else {
-        weak_pixels.emplace_back(std::move(points));
+  WeakComponents components;
+  components.base = BinaryImage { width, height, 2 };
+  Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int t) {
+    for (int y = tiles[t].y_begin; y < tiles[t].y_end; ++y) {
+      for (int i = row_offsets[y]; i < row_offsets[y + 1]; ++i) {
+        if (labels[i] >= 0 && has_strong[labels[i]]) components.base[xs[i], y] = true;
       }
     }
   });
 
-  std::ranges::sort(weak_pixels, std::greater<> {}, [&](const auto& v) { return v.size(); });
+  // Pixels of the free components grouped by rank, and of the strong ones by label, in raster
+  // order within a component.
+  std::vector<int> position(nr_components);
+  components.offsets.reserve(weak_components.size() + 1);
+  components.offsets.push_back(0);
+  for (int label : weak_components) {
+    position[label] = components.offsets.back();
+    components.offsets.push_back(components.offsets.back() + sizes[label]);
+  }
+  components.strong_offsets.reserve(nr_components - weak_components.size() + 1);
+  components.strong_offsets.push_back(0);
+  for (int label = 0; label < nr_components; ++label) {
+    if (!has_strong[label]) continue;
+    position[label] = components.strong_offsets.back();
+    components.strong_offsets.push_back(components.strong_offsets.back() + sizes[label]);
+  }
 
-  const int take_amount = static_cast<int>(weak_pixels.size() * take_percentile);
-  for (const auto& v : std::views::take(weak_pixels, take_amount)) {
-    for (auto p : v) {
-      result[p.x, p.y] = 1;
+  components.pixels.resize(components.offsets.back());
+  components.strong_pixels.resize(components.strong_offsets.back());
+  for (int y = 0; y < height; ++y) {
+    for (int i = row_offsets[y]; i < row_offsets[y + 1]; ++i) {
+      int label = labels[i];
+      if (label < 0) continue;
+      auto& pixels = has_strong[label] ? components.strong_pixels : components.pixels;
+      pixels[position[label]++] = y * width + xs[i];
     }
   }
 
+  Profiler::count(Profiler::Counter::weak_components, components.size());
+  return components;
+}
+
+int nr_taken_components(const WeakComponents& components, float take_percentile) {
+  // Percentiles outside [0, 1] would take components that don't exist.
+  float fraction = std::clamp(take_percentile, 0.0f, 1.0f);
+  return std::clamp(static_cast<int>(components.size() * fraction), 0, components.size());
+}
+
+void paint_components(
+  const WeakComponents& components,
+  int first,
+  int last,
+  bool value,
+  BinaryImage& image
+) {
+  const int width = image.width();
+  for (int i = components.offsets[first]; i < components.offsets[last]; ++i) {
+    int pixel = components.pixels[i];
+    image[pixel % width, pixel / width] = value;
+  }
+}
+
+BinaryImage apply_hysteresis(const WeakComponents& components, float take_percentile) {
+  BinaryImage result = components.base;
+  int taken = nr_taken_components(components, take_percentile);
+  paint_components(components, 0, taken, true, result);
+  Profiler::count(Profiler::Counter::taken_components, taken);
   return result;
 }
 
+BinaryImage
+apply_hysteresis(const EdgePixels& edges, float low, float high, float take_percentile) {
+  return apply_hysteresis(label_weak_components(edges, low, high), take_percentile);
+}
+
+std::vector<std::span<const int>>
+kept_components(const WeakComponents& components, float take_percentile) {
+  int taken = nr_taken_components(components, take_percentile);
+  Profiler::count(Profiler::Counter::taken_components, taken);
+
+  std::vector<std::span<const int>> kept;
+  kept.reserve(components.strong_offsets.size() - 1 + taken);
+  auto add = [&](const std::vector<int>& offsets, const std::vector<int>& pixels, int count) {
+    for (int c = 0; c < count; ++c) {
+      kept.emplace_back(pixels.data() + offsets[c], pixels.data() + offsets[c + 1]);
+    }
+  };
+  const auto& strong_offsets = components.strong_offsets;
+  add(strong_offsets, components.strong_pixels, static_cast<int>(strong_offsets.size()) - 1);
+  add(components.offsets, components.pixels, taken);
+  return kept;
+}
+
 BinaryImage detect_edges(const RGBImage& source_image) {
-  auto blurred_image = apply_adaptive_blur(source_image);
-  auto gradient_image = compute_gradient(blurred_image);
-  auto thinned_image = thin_edges(gradient_image);
-  auto [tl, th] = compute_threshold(thinned_image);
-  auto final_image = apply_hysteresis(thinned_image, tl, th);
-  return final_image;
+  auto components = detect_edge_components(source_image);
+  return apply_hysteresis(components);
+}
+
+WeakComponents detect_edge_components(const RGBImage& source_image) {
+  using Profiler::timed;
+  auto blurred_image = timed("blur", [&] { return apply_adaptive_blur(source_image); });
+  auto gradient_image = timed("gradient", [&] { return compute_gradient(blurred_image); });
+  auto edges = timed("thinning", [&] { return thin_edges(gradient_image); });
+  auto [tl, th] = timed("threshold", [&] { return compute_threshold(edges); });
+  return timed("hysteresis", [&] { return label_weak_components(edges, tl, th); });
 }
 
 }  // namespace Canny
\ No newline at end of file
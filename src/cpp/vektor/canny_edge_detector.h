@@ -1,6 +1,11 @@
 #pragma once
+#include <span>
+#include <utility>
+#include <vector>
+
 #include "image.h"
 #include "kernel.h"
+#include "planar_image.h"
 
 namespace Canny {
 
@@ -33,12 +38,103 @@ constexpr Image::Kernel<5> gradient_y_kernel {
 constexpr int MAX_BINS = 256;
 constexpr int padding_requirement = gradient_x_kernel.size() / 2;
 
-Image::RGBImage apply_adaptive_blur(const Image::RGBImage&, float = 1.0f, int = 1, int = 1);
+// direct: gathers the (2k+1)^2 window for every pixel.
+// summed_area: box sums of w and w * src from running column sums and a per-row prefix sum,
+// accumulated in double. Same cost at every kernel size; agrees with direct to within 1e-5.
+enum class BlurMethod { direct, summed_area };
+
+Image::RGBImage apply_adaptive_blur(
+  const Image::RGBImage&,
+  float = 1.0f,
+  int = 1,
+  int = 1,
+  BlurMethod = BlurMethod::summed_area
+);
+Image::PlanarRGBImage apply_adaptive_blur(
+  const Image::PlanarRGBImage&,
+  float = 1.0f,
+  int = 1,
+  int = 1,
+  BlurMethod = BlurMethod::summed_area
+);
+
+// A single iteration of apply_adaptive_blur, so that callers can keep and resume from the
+// intermediate images: n iterations from apply_adaptive_blur(image, h, k, m) equal
+// apply_adaptive_blur(image, h, k, m + n). The result is padded as apply_adaptive_blur's is.
+Image::RGBImage apply_adaptive_blur_iteration(
+  const Image::RGBImage&,
+  float = 1.0f,
+  int = 1,
+  BlurMethod = BlurMethod::summed_area
+);
+Image::PlanarRGBImage apply_adaptive_blur_iteration(
+  const Image::PlanarRGBImage&,
+  float = 1.0f,
+  int = 1,
+  BlurMethod = BlurMethod::summed_area
+);
+
 Image::GradientImage compute_gradient(const Image::RGBImage&);
-Image::GreyscaleImage thin_edges(const Image::GradientImage&);
-std::pair<float, float> compute_threshold(const Image::GreyscaleImage&, int = 256);
-Image::BinaryImage apply_hysteresis(const Image::GreyscaleImage&, float, float, float = 0.25f);
+Image::GradientImage compute_gradient(const Image::PlanarRGBImage&);
+
+// The nonzero pixels of a thinned image, in raster order. They are usually a few percent of the
+// image, so everything after thinning works on them rather than on the image.
+struct EdgePixels {
+  int width = 0;
+  int height = 0;
+
+  // Row y holds xs and magnitudes [row_offsets[y], row_offsets[y + 1]).
+  std::vector<int> row_offsets;
+  std::vector<int> xs;
+  std::vector<float> magnitudes;
+
+  // The edge pixels in compute_threshold's MAX_BINS + 1 bins, counted while thinning.
+  std::vector<int> histogram;
+
+  int size() const noexcept {
+    return static_cast<int>(xs.size());
+  }
+};
+
+EdgePixels thin_edges(const Image::GradientImage&);
+Image::GreyscaleImage to_image(const EdgePixels&);
+std::pair<float, float> compute_threshold(const EdgePixels&, int = MAX_BINS);
+Image::BinaryImage apply_hysteresis(const EdgePixels&, float, float, float = 0.25f);
+
+// The weak pixels of a thinned image in 8-connected components: those connected to a strong pixel,
+// which hysteresis always keeps, and the free ones, which it takes largest first.
+struct WeakComponents {
+  // Strong pixels and the components connected to them, padded like apply_hysteresis' result.
+  Image::BinaryImage base;
+
+  // The free component ranked r consists of the raster indices pixels[offsets[r]] up to
+  // pixels[offsets[r + 1]]; rank 0 is the largest.
+  std::vector<int> offsets;
+  std::vector<int> pixels;
+
+  // The components in base, laid out the same way, in order of their first pixel.
+  std::vector<int> strong_offsets;
+  std::vector<int> strong_pixels;
+
+  int size() const noexcept {
+    return static_cast<int>(offsets.size()) - 1;
+  }
+};
+
+// Labelling and ranking are the expensive half of apply_hysteresis; with the components kept,
+// moving the take percentile only paints or clears the components between the old and the new
+// cut.
+WeakComponents label_weak_components(const EdgePixels&, float, float);
+int nr_taken_components(const WeakComponents&, float);
+void paint_components(const WeakComponents&, int, int, bool, Image::BinaryImage&);
+Image::BinaryImage apply_hysteresis(const WeakComponents&, float = 0.25f);
+
+// apply_hysteresis without the image: the pixels of every component it keeps, in raster order,
+// strong components first and then the free ones by rank. They point into the WeakComponents.
+std::vector<std::span<const int>> kept_components(const WeakComponents&, float = 0.25f);
 
 Image::BinaryImage detect_edges(const Image::RGBImage&);
+// detect_edges up to the labelling, for tracing straight from kept_components.
+WeakComponents detect_edge_components(const Image::RGBImage&);
 
 }  // namespace Canny
\ No newline at end of file
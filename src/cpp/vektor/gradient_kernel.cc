@@ -0,0 +1,175 @@
+#include "gradient_kernel.h"
+
+#include <concepts>
+#include <cstring>
+#include <utility>
+
+#include "canny_edge_detector.h"
+#include "kernel.h"
+
+using Image::PlanarRGBImage;
+using Image::RGBImage;
+
+// GCC and Clang lower these to SSE/AVX2/AVX-512 on x86 and to simd128 on wasm.
+#if defined(__AVX512F__)
+constexpr int LANES = 16;
+#elif defined(__AVX__)
+constexpr int LANES = 8;
+#else
+constexpr int LANES = 4;
+#endif
+using Lanes = float __attribute__((vector_size(LANES * sizeof(float))));
+
+constexpr int R = Canny::padding_requirement;
+constexpr int N = 2 * R + 1;
+constexpr int NR_CHANNELS = 3;
+
+// rows[ch][r] points at x = -R of row y + r - R of channel ch.
+using RowPointers = const float* [NR_CHANNELS][N];
+
+template <typename V>
+V load(const float* p) noexcept {
+  if constexpr (std::same_as<V, float>) {
+    return *p;
+  } else {
+    V v;
+    std::memcpy(&v, p, sizeof(V));
+    return v;
+  }
+}
+
+template <typename V>
+void store(float* p, V v) noexcept {
+  if constexpr (std::same_as<V, float>) {
+    *p = v;
+  } else {
+    std::memcpy(p, &v, sizeof(V));
+  }
+}
+
+// Same taps as Image::evaluate_kernel, with the zero taps dropped at compile time.
+template <typename V>
+void evaluate_lanes(const RowPointers& rows, int x, V& a, V& b, V& c) noexcept {
+  a = b = c = V {};
+  for (int ch = 0; ch < NR_CHANNELS; ++ch) {
+    V gx {}, gy {};
+    [&]<std::size_t... T>(std::index_sequence<T...>) {
+      auto tap = [&]<std::size_t t>() {
+        constexpr int i = t % N, j = t / N;
+        constexpr float kx = Canny::gradient_x_kernel[i, j];
+        constexpr float ky = Canny::gradient_y_kernel[i, j];
+        if constexpr (kx != 0.0f || ky != 0.0f) {
+          V f = load<V>(rows[ch][N - 1 - j] + x + N - 1 - i);
+          if constexpr (kx != 0.0f) gx += kx * f;
+          if constexpr (ky != 0.0f) gy += ky * f;
+        }
+      };
+      (tap.template operator()<T>(), ...);
+    }(std::make_index_sequence<N * N> {});
+
+    gx /= static_cast<float>(Canny::gradient_x_kernel.normalizing_factor);
+    gy /= static_cast<float>(Canny::gradient_y_kernel.normalizing_factor);
+    a += gx * gx;
+    b += gx * gy;
+    c += gy * gy;
+  }
+}
+
+void evaluate_row(const RowPointers& rows, int width, Canny::StructureTensorRow& row) {
+  int x = 0;
+  for (; x + LANES <= width; x += LANES) {
+    Lanes a, b, c;
+    evaluate_lanes(rows, x, a, b, c);
+    store(row.a.data() + x, a);
+    store(row.b.data() + x, b);
+    store(row.c.data() + x, c);
+  }
+
+  for (; x < width; ++x) {
+    evaluate_lanes(rows, x, row.a[x], row.b[x], row.c[x]);
+  }
+}
+
+namespace Canny {
+
+void for_each_structure_tensor_row(
+  const RGBImage& image,
+  int y_begin,
+  int y_end,
+  const std::function<void(int, const StructureTensorRow&)>& f
+) {
+  const int width = image.width();
+  const int stride = width + 2 * R;
+
+  // Planar copies of the N rows under the kernel, reused as a ring buffer.
+  std::vector<float> ring(N * NR_CHANNELS * stride);
+  auto plane = [&](int ch, int y) {
+    return ring.data() + (NR_CHANNELS * ((y + N) % N) + ch) * stride;
+  };
+  auto load_row = [&](int y) {
+    const glm::vec3* src = &image[-R, y];
+    for (int ch = 0; ch < NR_CHANNELS; ++ch) {
+      float* dst = plane(ch, y);
+      for (int x = 0; x < stride; ++x) {
+        dst[x] = src[x][ch];
+      }
+    }
+  };
+
+  StructureTensorRow row;
+  row.a.resize(width), row.b.resize(width), row.c.resize(width);
+  for (int y = y_begin - R; y < y_begin + R; ++y) {
+    load_row(y);
+  }
+
+  for (int y = y_begin; y < y_end; ++y) {
+    load_row(y + R);
+
+    RowPointers rows;
+    for (int ch = 0; ch < NR_CHANNELS; ++ch) {
+      for (int r = 0; r < N; ++r) {
+        rows[ch][r] = plane(ch, y + r - R);
+      }
+    }
+
+    evaluate_row(rows, width, row);
+    f(y, row);
+  }
+}
+
+void for_each_structure_tensor_row(
+  const PlanarRGBImage& image,
+  int y_begin,
+  int y_end,
+  const std::function<void(int, const StructureTensorRow&)>& f
+) {
+  const int width = image.width();
+
+  StructureTensorRow row;
+  row.a.resize(width), row.b.resize(width), row.c.resize(width);
+  for (int y = y_begin; y < y_end; ++y) {
+    RowPointers rows;
+    for (int ch = 0; ch < NR_CHANNELS; ++ch) {
+      for (int r = 0; r < N; ++r) {
+        rows[ch][r] = &image[-R, y + r - R, ch];
+      }
+    }
+
+    evaluate_row(rows, width, row);
+    f(y, row);
+  }
+}
+
+void evaluate_structure_tensor_reference(const RGBImage& image, int y, StructureTensorRow& row) {
+  const int width = image.width();
+  row.a.resize(width), row.b.resize(width), row.c.resize(width);
+  for (int x = 0; x < width; ++x) {
+    auto gx = Image::evaluate_kernel<glm::vec3>(Canny::gradient_x_kernel, image, x, y);
+    auto gy = Image::evaluate_kernel<glm::vec3>(Canny::gradient_y_kernel, image, x, y);
+    row.a[x] = glm::dot(gx, gx);
+    row.b[x] = glm::dot(gx, gy);
+    row.c[x] = glm::dot(gy, gy);
+  }
+}
+
+}  // namespace Canny
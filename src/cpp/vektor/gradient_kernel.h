@@ -0,0 +1,37 @@
+#pragma once
+#include <functional>
+#include <vector>
+
+#include "image.h"
+#include "planar_image.h"
+
+namespace Canny {
+
+// Structure tensor terms of the Scharr 5x5 colour gradient for one row:
+// a = dot(gx, gx), b = dot(gx, gy), c = dot(gy, gy).
+struct StructureTensorRow {
+  std::vector<float> a, b, c;
+};
+
+// Calls f(y, row) for every row in [y_begin, y_end), evaluating several pixels per instruction.
+// The image needs a padding of at least padding_requirement.
+void for_each_structure_tensor_row(
+  const Image::RGBImage&,
+  int,
+  int,
+  const std::function<void(int, const StructureTensorRow&)>&
+);
+
+// Reads the planes in place, without the deinterleaving copy.
+void for_each_structure_tensor_row(
+  const Image::PlanarRGBImage&,
+  int,
+  int,
+  const std::function<void(int, const StructureTensorRow&)>&
+);
+
+// Scalar reference built on Image::evaluate_kernel; for_each_structure_tensor_row gives the same
+// values, which vektor_bench checks.
+void evaluate_structure_tensor_reference(const Image::RGBImage&, int, StructureTensorRow&);
+
+}  // namespace Canny
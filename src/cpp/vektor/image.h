@@ -1,9 +1,12 @@
 #pragma once
+#include <cstdint>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 #include <utility>
 #include <vector>
 
+#include "binary_image.h"
+
 namespace Image {
 
 inline void apply_with_inset(int width, int height, int inset_x, int inset_y, auto&& f) {
@@ -68,9 +71,63 @@ private:
 
 using RGBAImage = Image<glm::vec4>;
 using RGBImage = Image<glm::vec3>;
-using Gradient = std::pair<float, float>;
-using GradientImage = Image<Gradient>;
 using GreyscaleImage = Image<float>;
-using BinaryImage = Image<char>;
+
+// Gradient magnitude along with the direction of the gradient quantized to four buckets.
+class Gradient {
+public:
+  enum class Direction : std::uint8_t { horizontal, diagonal, vertical, anti_diagonal };
+
+  Gradient() = default;
+  Gradient(float magnitude, Direction direction) noexcept
+      : m_magnitude { magnitude }, m_direction { direction } {}
+
+  float magnitude() const noexcept {
+    return m_magnitude;
+  }
+
+  Direction direction() const noexcept {
+    return m_direction;
+  }
+
+private:
+  float m_magnitude = 0.0f;
+  Direction m_direction = Direction::horizontal;
+};
+
+// The magnitudes and the directions are kept in two images of the same size, five bytes a pixel.
+// The magnitudes are left as computed; max_magnitude is the largest of them, which they are
+// normalized by where they are used.
+class GradientImage {
+public:
+  GradientImage(int width = 0, int height = 0, int padding = 0)
+      : magnitudes { width, height, padding }, directions { width, height, padding } {}
+
+  Gradient operator[](int x, int y) const noexcept {
+    return { magnitudes[x, y], directions[x, y] };
+  }
+
+  int width() const noexcept {
+    return magnitudes.width();
+  }
+
+  int height() const noexcept {
+    return magnitudes.height();
+  }
+
+  int padding() const noexcept {
+    return magnitudes.padding();
+  }
+
+  void clear() noexcept {
+    magnitudes.clear();
+    directions.clear();
+    max_magnitude = 0.0f;
+  }
+
+  Image<float> magnitudes;
+  Image<Gradient::Direction> directions;
+  float max_magnitude = 0.0f;
+};
 
 }  // namespace Image
\ No newline at end of file
@@ -1,4 +1,11 @@
+#include "image_io.h"
+
+#include <exception>
+#include <istream>
+#include <iterator>
+#include <limits>
 #include <stdexcept>
+#include <string>
 
 #include "image.h"
 
@@ -7,29 +14,103 @@
 #include <stb_image.h>
 #include <stb_image_write.h>
 
+namespace {
+
+// Greyscale and grey-alpha files are expanded to RGB by stb.
+constexpr int NR_CHANNELS = 3;
+
+Image::RGBImage to_rgb_image(unsigned char* data, int width, int height, int padding) {
+  Image::RGBImage image { width, height, padding };
+  Image::apply(width, height, [&](int x, int y) {
+    int index = y * width + x;
+    float r = static_cast<float>(data[index * NR_CHANNELS + 0]);
+    float g = static_cast<float>(data[index * NR_CHANNELS + 1]);
+    float b = static_cast<float>(data[index * NR_CHANNELS + 2]);
+    image[x, y] = glm::vec3(r, g, b) / 255.0f;
+  });
+
+  stbi_image_free(data);
+  return image;
+}
+
+}  // namespace
+
 namespace Image {
 
 RGBImage load(const char* path, int padding) {
   int width, height, nr_channels;
-  unsigned char* data = stbi_load(path, &width, &height, &nr_channels, 0);
+  unsigned char* data = stbi_load(path, &width, &height, &nr_channels, NR_CHANNELS);
 
   if (data == nullptr) {
-    throw std::runtime_error("File not found: " + std::string(path));
+    throw std::runtime_error("Could not load " + std::string(path) + ": " + stbi_failure_reason());
   }
 
-  RGBImage image { width, height, padding };
-  apply(width, height, [&](int x, int y) {
-    int index = y * width + x;
-    float r = static_cast<float>(data[index * nr_channels + 0]);
-    float g = static_cast<float>(data[index * nr_channels + 1]);
-    float b = static_cast<float>(data[index * nr_channels + 2]);
-    image[x, y] = glm::vec3(r, g, b) / 255.0f;
-  });
+  return to_rgb_image(data, width, height, padding);
+}
 
-  stbi_image_free(data);
-  return image;
+RGBImage load_from_memory(std::span<const std::byte> bytes, int padding) {
+  if (bytes.size() > static_cast<std::size_t>(std::numeric_limits<int>::max())) {
+    throw std::runtime_error("Could not load image: too large");
+  }
+
+  int width, height, nr_channels;
+  unsigned char* data = stbi_load_from_memory(
+    reinterpret_cast<const unsigned char*>(bytes.data()),
+    static_cast<int>(bytes.size()),
+    &width,
+    &height,
+    &nr_channels,
+    NR_CHANNELS
+  );
+
+  if (data == nullptr) {
+    throw std::runtime_error(std::string("Could not load image: ") + stbi_failure_reason());
+  }
+
+  return to_rgb_image(data, width, height, padding);
+}
+
+RGBImage load(std::istream& stream, int padding) {
+  std::vector<char> bytes { std::istreambuf_iterator<char> { stream }, {} };
+  return load_from_memory(std::as_bytes(std::span { bytes }), padding);
+}
+
+std::pair<int, int> load_size(const char* path) {
+  int width, height, nr_channels;
+  if (!stbi_info(path, &width, &height, &nr_channels)) {
+    throw std::runtime_error("Could not load " + std::string(path) + ": " + stbi_failure_reason());
+  }
+  return { width, height };
 }
 
-int (*stbi_write_png_impl)(const char*, int, int, int, const void*, int) = &stbi_write_png;
+void write_png(const char* path, int width, int height, const std::vector<unsigned char>& data) {
+  int stride = width * NR_CHANNELS;
+  if (!stbi_write_png(path, width, height, NR_CHANNELS, data.data(), stride)) {
+    throw std::runtime_error("Could not write: " + std::string(path));
+  }
+}
+
+void write_png(const Sink& sink, int width, int height, const std::vector<unsigned char>& data) {
+  struct Context {
+    const Sink& sink;
+    std::exception_ptr error;
+  } context { sink, nullptr };
+
+  // Exceptions from the sink are carried past stb, which would leak its buffer otherwise.
+  auto write = [](void* context, void* bytes, int size) {
+    auto& [sink, error] = *static_cast<Context*>(context);
+    try {
+      sink({ static_cast<const std::byte*>(bytes), static_cast<std::size_t>(size) });
+    } catch (...) {
+      error = std::current_exception();
+    }
+  };
+
+  int stride = width * NR_CHANNELS;
+  bool written =
+    stbi_write_png_to_func(write, &context, width, height, NR_CHANNELS, data.data(), stride);
+  if (context.error) std::rethrow_exception(context.error);
+  if (!written) throw std::runtime_error("Could not encode PNG");
+}
 
-}  // namespace Image
\ No newline at end of file
+}  // namespace Image
@@ -1,14 +1,36 @@
 #pragma once
+#include <concepts>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
 #include "image.h"
 
 namespace Image {
 
 RGBImage load(const char*, int padding = 0);
 
-extern int (*stbi_write_png_impl)(const char*, int, int, int, const void*, int);
+// Decodes an encoded image held in memory, or read to the end of the stream, in any format the
+// path overload reads.
+RGBImage load_from_memory(std::span<const std::byte>, int padding = 0);
+RGBImage load(std::istream&, int padding = 0);
+
+// Width and height from the file header, without decoding the pixels.
+std::pair<int, int> load_size(const char*);
+
+// Receives the encoded file in pieces, in order.
+using Sink = std::function<void(std::span<const std::byte>)>;
+
+// 8-bit RGB pixels, row by row, written as a PNG. Throws if the encoding or the write fails.
+void write_png(const char*, int, int, const std::vector<unsigned char>&);
+void write_png(const Sink&, int, int, const std::vector<unsigned char>&);
 
 template <typename T>
-void save_as_png(const Image<T>& image, const char* path) {
+std::vector<unsigned char> png_pixels(const Image<T>& image) {
   const int width = image.width();
   const int height = image.height();
   constexpr int NR_CHANNELS = 3;
@@ -29,8 +51,24 @@ void save_as_png(const Image<T>& image, const char* path) {
     }
   });
 
-  int stride = width * NR_CHANNELS;
-  stbi_write_png_impl(path, width, height, NR_CHANNELS, data.data(), stride);
+  return data;
+}
+
+template <typename T>
+void save_as_png(const Image<T>& image, const char* path) {
+  write_png(path, image.width(), image.height(), png_pixels(image));
+}
+
+template <typename T>
+void save_as_png(const Image<T>& image, const Sink& sink) {
+  write_png(sink, image.width(), image.height(), png_pixels(image));
+}
+
+void save_as_png(const auto& image, std::ostream& stream) {
+  save_as_png(image, [&stream](std::span<const std::byte> bytes) {
+    stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    if (!stream) throw std::runtime_error("Could not write the PNG");
+  });
 }
 
-}  // namespace Image
\ No newline at end of file
+}  // namespace Image
@@ -0,0 +1,140 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "image.h"
+
+namespace Image {
+
+// Multi-channel image stored as one contiguous float plane per channel. image[x, y] reads and
+// writes a whole pixel as T, image[x, y, channel] a single sample.
+template <typename T>
+class PlanarImage {
+public:
+  static constexpr int NR_CHANNELS = T::length();
+
+  class PixelRef {
+  public:
+    PixelRef(float* sample, std::size_t plane_size) noexcept
+        : m_sample { sample }, m_plane_size { plane_size } {}
+
+    operator T() const noexcept {
+      T value;
+      for (int c = 0; c < NR_CHANNELS; ++c) {
+        value[c] = m_sample[c * m_plane_size];
+      }
+      return value;
+    }
+
+    PixelRef& operator=(const T& value) noexcept {
+      for (int c = 0; c < NR_CHANNELS; ++c) {
+        m_sample[c * m_plane_size] = value[c];
+      }
+      return *this;
+    }
+
+    PixelRef& operator=(const PixelRef& other) noexcept {
+      return *this = static_cast<T>(other);
+    }
+
+    PixelRef& operator+=(const T& value) noexcept {
+      return *this = static_cast<T>(*this) + value;
+    }
+
+    PixelRef& operator/=(float value) noexcept {
+      return *this = static_cast<T>(*this) / value;
+    }
+
+  private:
+    float* m_sample;
+    std::size_t m_plane_size;
+  };
+
+  PlanarImage(int width = 0, int height = 0, int padding = 0)
+      : m_width { width },
+        m_height { height },
+        m_padding { padding },
+        m_data(NR_CHANNELS * plane_size()) {}
+
+  PlanarImage(const PlanarImage& image, int padding)
+      : PlanarImage { image.width(), image.height(), padding } {
+    copy_from(image);
+  }
+
+  PlanarImage(const Image<T>& image, int padding)
+      : PlanarImage { image.width(), image.height(), padding } {
+    copy_from(image);
+  }
+
+  PixelRef operator[](int x, int y) noexcept {
+    return { &m_data[index(x, y)], plane_size() };
+  }
+
+  T operator[](int x, int y) const noexcept {
+    T value;
+    for (int c = 0; c < NR_CHANNELS; ++c) {
+      value[c] = m_data[c * plane_size() + index(x, y)];
+    }
+    return value;
+  }
+
+  decltype(auto) operator[](this auto&& self, int x, int y, int channel) noexcept {
+    return std::forward_like<decltype(self)>(
+      self.m_data[channel * self.plane_size() + self.index(x, y)]
+    );
+  }
+
+  // Pointer to (0, y) of the given channel; rows are contiguous including the padding.
+  float* row(int channel, int y) noexcept {
+    return &this->operator[](0, y, channel);
+  }
+
+  const float* row(int channel, int y) const noexcept {
+    return &this->operator[](0, y, channel);
+  }
+
+  int width() const noexcept {
+    return m_width;
+  }
+
+  int height() const noexcept {
+    return m_height;
+  }
+
+  int padding() const noexcept {
+    return m_padding;
+  }
+
+  auto data() const noexcept -> const std::vector<float>& {
+    return m_data;
+  }
+
+  void clear() noexcept {
+    m_width = m_height = m_padding = 0;
+    m_data.clear();
+  }
+
+private:
+  int m_width, m_height;
+  int m_padding;
+  std::vector<float> m_data;
+
+  std::size_t plane_size() const noexcept {
+    return static_cast<std::size_t>(m_width + 2 * m_padding) * (m_height + 2 * m_padding);
+  }
+
+  std::size_t index(int x, int y) const noexcept {
+    return static_cast<std::size_t>(m_width + 2 * m_padding) * (y + m_padding) + (x + m_padding);
+  }
+
+  void copy_from(const auto& image) {
+    apply(m_width, m_height, [&image, this](int x, int y) {
+      this->operator[](x, y) = image[x, y];
+    });
+  }
+};
+
+using PlanarRGBImage = PlanarImage<glm::vec3>;
+
+}  // namespace Image
@@ -0,0 +1,128 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <format>
+#include <numeric>
+#include <utility>
+
+#if __has_include(<malloc.h>)
+#include <malloc.h>
+#endif
+
+namespace Profiler {
+
+namespace {
+
+thread_local Profile* current_profile = nullptr;
+
+// Large blocks, image buffers among them, are mmapped and counted in hblkhd, not uordblks.
+std::size_t heap_bytes_in_use() noexcept {
+#if defined(__EMSCRIPTEN__)
+  auto info = mallinfo();
+  return static_cast<std::size_t>(info.uordblks) + static_cast<std::size_t>(info.hblkhd);
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+void sample_heap(Profile& profile) noexcept {
+  profile.peak_bytes = std::max(profile.peak_bytes, heap_bytes_in_use());
+}
+
+}  // namespace
+
+const char* counter_name(Counter counter) noexcept {
+  switch (counter) {
+    case Counter::pixels: return "pixels";
+    case Counter::strong_components: return "strong_components";
+    case Counter::weak_components: return "weak_components";
+    case Counter::taken_components: return "taken_components";
+    case Counter::paths: return "paths";
+    case Counter::curves: return "curves";
+  }
+  return "";
+}
+
+double Profile::total_milliseconds() const noexcept {
+  return std::accumulate(stages.begin(), stages.end(), 0.0, [](double sum, const Stage& stage) {
+    return sum + stage.milliseconds;
+  });
+}
+
+std::string Profile::to_json() const {
+  std::string json = "{\"stages\":[";
+  for (std::size_t i = 0; i < stages.size(); ++i) {
+    json += std::format(
+      "{}{{\"name\":\"{}\",\"milliseconds\":{:.3f},\"calls\":{}}}",
+      i == 0 ? "" : ",",
+      stages[i].name,
+      stages[i].milliseconds,
+      stages[i].calls
+    );
+  }
+  json += "],\"counters\":{";
+  for (int i = 0; i < nr_counters; ++i) {
+    json += std::format(
+      "{}\"{}\":{}", i == 0 ? "" : ",", counter_name(static_cast<Counter>(i)), counters[i]
+    );
+  }
+  json += std::format(
+    "}},\"total_milliseconds\":{:.3f},\"peak_bytes\":{}}}", total_milliseconds(), peak_bytes
+  );
+  return json;
+}
+
+std::string Profile::to_string() const {
+  std::string text;
+  for (const auto& stage : stages) {
+    text += std::format("{:<16}{:>10.3f} ms  x{}\n", stage.name, stage.milliseconds, stage.calls);
+  }
+  text += std::format("{:<16}{:>10.3f} ms\n", "total", total_milliseconds());
+  for (int i = 0; i < nr_counters; ++i) {
+    text += std::format("{:<18}{:>12}\n", counter_name(static_cast<Counter>(i)), counters[i]);
+  }
+  text += std::format("{:<18}{:>12}\n", "peak_bytes", peak_bytes);
+  return text;
+}
+
+Session::Session(Profile& profile) : m_previous { std::exchange(current_profile, &profile) } {
+  sample_heap(profile);
+}
+
+Session::~Session() {
+  current_profile = m_previous;
+}
+
+bool enabled() noexcept {
+  return current_profile != nullptr;
+}
+
+void count(Counter counter, std::int64_t n) {
+  if (current_profile) current_profile->counters[static_cast<int>(counter)] += n;
+}
+
+Stage::Stage(const char* name) : m_profile { current_profile }, m_name { name } {
+  if (!m_profile) return;
+  sample_heap(*m_profile);
+  m_start = std::chrono::steady_clock::now();
+}
+
+Stage::~Stage() {
+  if (!m_profile) return;
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - m_start;
+
+  auto& stages = m_profile->stages;
+  auto it = std::ranges::find_if(stages, [&](const auto& stage) {
+    return std::strcmp(stage.name.c_str(), m_name) == 0;
+  });
+  if (it == stages.end()) it = stages.insert(stages.end(), { m_name });
+  it->milliseconds += elapsed.count();
+  ++it->calls;
+  sample_heap(*m_profile);
+}
+
+}  // namespace Profiler
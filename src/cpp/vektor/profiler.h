@@ -0,0 +1,90 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Profiler {
+
+enum class Counter {
+  pixels,             // pixels read by the image stages, summed over stages and blur iterations
+  strong_components,  // components of edge pixels with a pixel at or above the high threshold
+  weak_components,    // components of weak pixels not connected to a strong one
+  taken_components,   // free weak components taken as edges by take_percentile
+  paths,              // paths found by the tracer
+  curves,             // bezier curves fitted to those paths
+};
+
+inline constexpr int nr_counters = static_cast<int>(Counter::curves) + 1;
+
+const char* counter_name(Counter) noexcept;
+
+struct Profile {
+  struct Stage {
+    std::string name;
+    double milliseconds = 0.0;
+    int calls = 0;
+  };
+
+  // In order of first entry; a stage entered more than once accumulates.
+  std::vector<Stage> stages;
+  std::array<std::int64_t, nr_counters> counters {};
+  // The most heap bytes in use, mmapped blocks included, seen when a stage starts or ends. It is
+  // sampled rather than tracked, so a buffer allocated and freed within a stage is missed. Zero
+  // where the allocator can't report it.
+  std::size_t peak_bytes = 0;
+
+  std::int64_t operator[](Counter counter) const noexcept {
+    return counters[static_cast<int>(counter)];
+  }
+
+  double total_milliseconds() const noexcept;
+  std::string to_json() const;
+  std::string to_string() const;
+};
+
+// Makes `profile` the calling thread's profile for the lifetime of the session. Without one,
+// stages and counters are a single thread_local load and branch.
+class Session {
+public:
+  explicit Session(Profile&);
+  ~Session();
+
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+private:
+  Profile* m_previous;
+};
+
+bool enabled() noexcept;
+
+// Adds to the counter of the calling thread's profile, if there is one. Parallel loops count on
+// the thread that started them.
+void count(Counter, std::int64_t);
+
+// Times the enclosing scope as the stage `name`.
+class Stage {
+public:
+  explicit Stage(const char* name);
+  ~Stage();
+
+  Stage(const Stage&) = delete;
+  Stage& operator=(const Stage&) = delete;
+
+private:
+  Profile* m_profile;
+  const char* m_name;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+template <typename F>
+decltype(auto) timed(const char* name, F&& f) {
+  Stage stage { name };
+  return std::forward<F>(f)();
+}
+
+}  // namespace Profiler
@@ -1,8 +1,15 @@
 #include "renderer.h"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
 #include <glm/glm.hpp>
 
 #include "bezier_curve.h"
+#include "profiler.h"
+#include "thread_pool.h"
 
 void draw_line(glm::dvec2 p1, glm::dvec2 p2, auto&& f) {
   auto i_part = [](double x) { return glm::floor(x); };
@@ -70,7 +77,105 @@ void draw_line(glm::dvec2 p1, glm::dvec2 p2, auto&& f) {
   }
 }
 
-void draw_curve(const BezierCurve& curve, auto&& f) {
+void draw_polyline(const Renderer::Polyline& polyline, auto&& f) {
+  for (std::size_t i = 1; i < polyline.size(); ++i) {
+    draw_line(polyline[i - 1], polyline[i], std::forward<decltype(f)>(f));
+  }
+}
+
+glm::vec3 curve_color(const Renderer::Polyline& polyline, const auto& image) {
+  glm::vec3 path_color {};
+  float weight_sum = 0.0f;
+  draw_polyline(polyline, [&](float x, float y, float c) {
+    x = glm::round(x), y = glm::round(y);
+    path_color += glm::vec3(image[x, y]) * c;
+    weight_sum += c;
+  });
+  path_color /= weight_sum;
+
+  return path_color;
+}
+
+// Side of the square screen tiles the rasterizer works on.
+constexpr int RASTER_TILE_SIZE = 256;
+
+// Pixels draw_line may touch beyond the bounding box of a segment's end points.
+constexpr double LINE_MARGIN = 2.0;
+
+// Calls background(x, y) for every pixel and then plot(i, x, y, c) for every pixel the polylines
+// cover, dropping pixels outside the image. Polylines are binned into screen tiles by bounding
+// box and the tiles rasterized in parallel; within a pixel, plot calls keep the polyline order.
+void rasterize(
+  int width,
+  int height,
+  const std::vector<const Renderer::Polyline*>& polylines,
+  auto&& background,
+  auto&& plot
+) {
+  if (width <= 0 || height <= 0) return;
+  Profiler::count(Profiler::Counter::pixels, static_cast<std::int64_t>(width) * height);
+
+  const int tiles_x = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  const int tiles_y = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  std::vector<std::vector<std::uint32_t>> bins(tiles_x * tiles_y);
+
+  for (std::size_t i = 0; i < polylines.size(); ++i) {
+    const auto& polyline = *polylines[i];
+    if (polyline.empty()) continue;
+
+    glm::dvec2 low = polyline.front(), high = polyline.front();
+    for (auto p : polyline) {
+      low = glm::min(low, p), high = glm::max(high, p);
+    }
+    low -= LINE_MARGIN, high += LINE_MARGIN;
+    if (high.x < 0.0 || high.y < 0.0 || low.x >= width || low.y >= height) continue;
+
+    auto tile_of = [](double v, int nr_tiles) {
+      return glm::clamp(static_cast<int>(v) / RASTER_TILE_SIZE, 0, nr_tiles - 1);
+    };
+    for (int ty = tile_of(glm::max(low.y, 0.0), tiles_y); ty <= tile_of(high.y, tiles_y); ++ty) {
+      for (int tx = tile_of(glm::max(low.x, 0.0), tiles_x); tx <= tile_of(high.x, tiles_x); ++tx) {
+        bins[ty * tiles_x + tx].push_back(static_cast<std::uint32_t>(i));
+      }
+    }
+  }
+
+  Parallel::for_each_index(tiles_x * tiles_y, [&](int tile) {
+    const int x_begin = tile % tiles_x * RASTER_TILE_SIZE;
+    const int y_begin = tile / tiles_x * RASTER_TILE_SIZE;
+    const int x_end = std::min(x_begin + RASTER_TILE_SIZE, width);
+    const int y_end = std::min(y_begin + RASTER_TILE_SIZE, height);
+
+    for (int y = y_begin; y < y_end; ++y) {
+      for (int x = x_begin; x < x_end; ++x) {
+        background(x, y);
+      }
+    }
+
+    for (auto i : bins[tile]) {
+      auto plot_inside = [&](float x, float y, float c) {
+        int xi = glm::round(x), yi = glm::round(y);
+        if (xi >= x_begin && xi < x_end && yi >= y_begin && yi < y_end) {
+          plot(i, xi, yi, c);
+        }
+      };
+
+      const auto& polyline = *polylines[i];
+      for (std::size_t j = 1; j < polyline.size(); ++j) {
+        auto low = glm::min(polyline[j - 1], polyline[j]) - LINE_MARGIN;
+        auto high = glm::max(polyline[j - 1], polyline[j]) + LINE_MARGIN;
+        if (high.x >= x_begin && low.x < x_end && high.y >= y_begin && low.y < y_end) {
+          draw_line(polyline[j - 1], polyline[j], plot_inside);
+        }
+      }
+    }
+  });
+}
+
+namespace Renderer {
+
+Polyline flatten_curve(BezierCurve curve, double scale) {
+  BezierCurve::scale(curve, scale);
   auto [p0, p1, p2, p3] = curve;
 
   auto square = [](auto x) { return x * x; };
@@ -83,18 +188,65 @@ void draw_curve(const BezierCurve& curve, auto&& f) {
   double e2 = 8.0 * delta <= dd ? 8.0 * delta / dd : 1.0;
   double epsilon = glm::sqrt(e2);
 
-  glm::dvec2 prev = p0;
+  Polyline polyline { p0 };
   for (double t = epsilon; t < 1.0; t += epsilon) {
     glm::dvec2 curr = p0 * cube(1.0 - t) + p1 * 3.0 * square(1.0 - t) * t +
                       p2 * 3.0 * (1.0 - t) * square(t) + p3 * cube(t);
+    polyline.push_back(curr);
+  }
+  polyline.push_back(p3);
 
-    draw_line(prev, curr, std::forward<decltype(f)>(f));
-    prev = curr;
+  return polyline;
+}
+
+std::size_t FlattenCache::CurveHash::operator()(const BezierCurve& curve) const noexcept {
+  std::size_t hash = 14695981039346656037ull;
+  for (auto word : std::bit_cast<std::array<std::uint64_t, 8>>(curve)) {
+    hash = (hash ^ word) * 1099511628211ull;
   }
-  draw_line(prev, p3, std::forward<decltype(f)>(f));
+  return hash;
 }
 
-namespace Renderer {
+bool FlattenCache::CurveEqual::operator()(const BezierCurve& a, const BezierCurve& b)
+  const noexcept {
+  return std::memcmp(&a, &b, sizeof(BezierCurve)) == 0;
+}
+
+auto FlattenCache::flatten(const std::vector<BezierCurveWithColor>& curves, double scale)
+  -> std::vector<const Polyline*> {
+  Entries previous;
+  auto it = std::ranges::find(m_scales, scale, &ScaleEntries::scale);
+  if (it != m_scales.end()) {
+    previous = std::move(it->entries);
+    m_scales.erase(it);
+  }
+
+  ScaleEntries current { .scale = scale, .entries = {} };
+  std::vector<const Polyline*> polylines;
+  polylines.reserve(curves.size());
+  for (const auto& [curve, _] : curves) {
+    auto found = current.entries.find(curve);
+    if (found == current.entries.end()) {
+      if (auto node = previous.extract(curve)) {
+        found = current.entries.insert(std::move(node)).position;
+      } else {
+        found = current.entries.emplace(curve, flatten_curve(curve, scale)).first;
+      }
+    }
+    polylines.push_back(&found->second);
+  }
+
+  m_scales.insert(m_scales.begin(), std::move(current));
+  if (m_scales.size() > max_scales) {
+    m_scales.pop_back();
+  }
+
+  return polylines;
+}
+
+void FlattenCache::clear() noexcept {
+  m_scales.clear();
+}
 
 auto render_greyscale(
   int width,
@@ -102,34 +254,48 @@ auto render_greyscale(
   const std::vector<BezierCurveWithColor>& curves,
   float background_value
 ) -> Image::GreyscaleImage {
-  Image::GreyscaleImage result { width, height };
-  Image::apply(width, height, [&](int x, int y) { result[x, y] = background_value; });
-
-  for (auto [curve, _] : curves) {
-    BezierCurve::scale(curve, width);
+  FlattenCache cache;
+  return render_greyscale(width, height, curves, background_value, cache);
+}
 
-    draw_curve(curve, [&](float x, float y, float c) {
-      x = glm::round(x), y = glm::round(y);
+auto render_greyscale(
+  int width,
+  int height,
+  const std::vector<BezierCurveWithColor>& curves,
+  float background_value,
+  FlattenCache& cache
+) -> Image::GreyscaleImage {
+  Image::GreyscaleImage result { width, height };
+  rasterize(
+    width,
+    height,
+    cache.flatten(curves, width),
+    [&](int x, int y) { result[x, y] = background_value; },
+    [&](std::size_t, int x, int y, float c) {
       result[x, y] = glm::mix(result[x, y], 1.0f - background_value, c);
-    });
-  }
+    }
+  );
 
   return result;
 }
 
 glm::vec3 compute_curve_color(BezierCurve curve, const Image::RGBImage& image) {
-  BezierCurve::scale(curve, image.width());
+  return curve_color(flatten_curve(curve, image.width()), image);
+}
 
-  glm::vec3 path_color {};
-  float weight_sum = 0.0f;
-  draw_curve(curve, [&](float x, float y, float c) {
-    x = glm::round(x), y = glm::round(y);
-    path_color += image[x, y] * c;
-    weight_sum += c;
-  });
-  path_color /= weight_sum;
+glm::vec3 compute_curve_color(BezierCurve curve, const Image::PlanarRGBImage& image) {
+  return curve_color(flatten_curve(curve, image.width()), image);
+}
 
-  return path_color;
+void compute_curve_colors(
+  std::vector<BezierCurveWithColor>& curves,
+  const Image::PlanarRGBImage& image,
+  FlattenCache& cache
+) {
+  auto polylines = cache.flatten(curves, image.width());
+  for (std::size_t i = 0; i < curves.size(); ++i) {
+    curves[i].color = curve_color(*polylines[i], image);
+  }
 }
 
 auto render_color(
@@ -137,17 +303,28 @@ auto render_color(
   int height,
   const std::vector<BezierCurveWithColor>& curves,
   glm::vec3 background_color
+) -> Image::RGBImage {
+  FlattenCache cache;
+  return render_color(width, height, curves, background_color, cache);
+}
+
+auto render_color(
+  int width,
+  int height,
+  const std::vector<BezierCurveWithColor>& curves,
+  glm::vec3 background_color,
+  FlattenCache& cache
 ) -> Image::RGBImage {
   Image::RGBImage result { width, height };
-  Image::apply(width, height, [&](int x, int y) { result[x, y] = background_color; });
-
-  for (auto [curve, color] : curves) {
-    BezierCurve::scale(curve, width);
-    draw_curve(curve, [&](float x, float y, float c) {
-      x = glm::round(x), y = glm::round(y);
-      result[x, y] = glm::mix(result[x, y], color, c);
-    });
-  }
+  rasterize(
+    width,
+    height,
+    cache.flatten(curves, width),
+    [&](int x, int y) { result[x, y] = background_color; },
+    [&](std::size_t i, int x, int y, float c) {
+      result[x, y] = glm::mix(result[x, y], curves[i].color, c);
+    }
+  );
 
   return result;
 }
@@ -1,15 +1,69 @@
 #pragma once
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
 #include "bezier_curve.h"
 #include "image.h"
+#include "planar_image.h"
 
 namespace Renderer {
 
+// A curve flattened to the points its line segments join, in output pixel coordinates.
+using Polyline = std::vector<glm::dvec2>;
+
+Polyline flatten_curve(BezierCurve, double);
+
+// Keeps the polylines of recently drawn curves so that curve colouring and rendering, and
+// re-renders that only change colours or the background, flatten each curve once. Curves are
+// matched bit for bit; polylines of the last few scales are kept.
+class FlattenCache {
+public:
+  // Polylines for curves scaled by `scale`, in curve order. The pointers stay valid until the
+  // next call.
+  auto flatten(const std::vector<BezierCurveWithColor>&, double) -> std::vector<const Polyline*>;
+  void clear() noexcept;
+
+private:
+  struct CurveHash {
+    std::size_t operator()(const BezierCurve&) const noexcept;
+  };
+
+  struct CurveEqual {
+    bool operator()(const BezierCurve&, const BezierCurve&) const noexcept;
+  };
+
+  using Entries = std::unordered_map<BezierCurve, Polyline, CurveHash, CurveEqual>;
+
+  struct ScaleEntries {
+    double scale;
+    Entries entries;
+  };
+
+  static constexpr std::size_t max_scales = 4;
+
+  // Most recently used first.
+  std::vector<ScaleEntries> m_scales;
+};
+
 auto render_greyscale(int, int, const std::vector<BezierCurveWithColor>&, float = 0.0f)
   -> Image::GreyscaleImage;
+auto render_greyscale(int, int, const std::vector<BezierCurveWithColor>&, float, FlattenCache&)
+  -> Image::GreyscaleImage;
 
 glm::vec3 compute_curve_color(BezierCurve, const Image::RGBImage&);
+glm::vec3 compute_curve_color(BezierCurve, const Image::PlanarRGBImage&);
+
+// Sets the colour of every curve, sharing the cache with the render functions.
+void compute_curve_colors(
+  std::vector<BezierCurveWithColor>&,
+  const Image::PlanarRGBImage&,
+  FlattenCache&
+);
 
 auto render_color(int, int, const std::vector<BezierCurveWithColor>&, glm::vec3 = glm::vec3(0.0f))
   -> Image::RGBImage;
+auto render_color(int, int, const std::vector<BezierCurveWithColor>&, glm::vec3, FlattenCache&)
+  -> Image::RGBImage;
 
-};  // namespace Renderer
\ No newline at end of file
+};  // namespace Renderer
@@ -0,0 +1,145 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+namespace Parallel {
+
+thread_local bool inside_pool = false;
+thread_local std::stop_token current_stop_token;
+
+CancellationScope::CancellationScope(std::stop_token token)
+    : m_previous { std::exchange(current_stop_token, std::move(token)) } {}
+
+CancellationScope::~CancellationScope() {
+  current_stop_token = std::move(m_previous);
+}
+
+void check_cancelled() {
+  if (current_stop_token.stop_requested()) throw Cancelled {};
+}
+
+int hardware_threads() noexcept {
+#if VEKTOR_HAS_THREADS
+  return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+#else
+  return 1;
+#endif
+}
+
+ThreadPool::ThreadPool(int nr_threads) {
+#if VEKTOR_HAS_THREADS
+  for (int i = 1; i < nr_threads; ++i) {
+    m_threads.emplace_back([this] { worker_loop(); });
+  }
+#endif
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock { m_mutex };
+    m_stop = true;
+  }
+  m_wake.notify_all();
+
+  for (auto& thread : m_threads) {
+    thread.join();
+  }
+}
+
+int ThreadPool::size() const noexcept {
+  return static_cast<int>(m_threads.size()) + 1;
+}
+
+void ThreadPool::for_each_index(int count, const std::function<void(int)>& f) {
+  std::unique_lock submit { m_submit, std::try_to_lock };
+  if (m_threads.empty() || count <= 1 || inside_pool || !submit.owns_lock()) {
+    for (int i = 0; i < count; ++i) {
+      check_cancelled();
+      f(i);
+    }
+    return;
+  }
+
+  Job job { f, count, current_stop_token };
+  {
+    std::lock_guard lock { m_mutex };
+    m_job = &job;
+    ++m_generation;
+  }
+  m_wake.notify_all();
+
+  inside_pool = true;
+  run(job);
+  inside_pool = false;
+
+  {
+    std::unique_lock lock { m_mutex };
+    m_finished.wait(lock, [&] { return job.done == job.count && m_active == 0; });
+    m_job = nullptr;
+  }
+
+  if (job.error) {
+    std::rethrow_exception(job.error);
+  }
+}
+
+void ThreadPool::worker_loop() {
+  inside_pool = true;
+
+  std::uint64_t generation = 0;
+  while (true) {
+    Job* job;
+    {
+      std::unique_lock lock { m_mutex };
+      m_wake.wait(lock, [&] { return m_stop || m_generation != generation; });
+      if (m_stop) return;
+
+      generation = m_generation;
+      if (m_job == nullptr) continue;
+      job = m_job;
+      ++m_active;
+    }
+
+    run(*job);
+
+    {
+      std::lock_guard lock { m_mutex };
+      --m_active;
+    }
+    m_finished.notify_all();
+  }
+}
+
+void ThreadPool::run(Job& job) {
+  CancellationScope scope { job.token };
+  for (int i = job.next++; i < job.count; i = job.next++) {
+    try {
+      check_cancelled();
+      job.f(i);
+    } catch (...) {
+      std::lock_guard lock { job.error_mutex };
+      if (!job.error) job.error = std::current_exception();
+    }
+    ++job.done;
+  }
+}
+
+std::unique_ptr<ThreadPool> pool;
+std::mutex pool_mutex;
+
+ThreadPool& default_pool() {
+  std::lock_guard lock { pool_mutex };
+  if (!pool) pool = std::make_unique<ThreadPool>();
+  return *pool;
+}
+
+void set_nr_threads(int nr_threads) {
+  std::lock_guard lock { pool_mutex };
+  if (pool) throw std::logic_error("The number of threads must be set before the pool is used");
+  pool = std::make_unique<ThreadPool>(std::max(1, nr_threads));
+}
+
+}  // namespace Parallel
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define VEKTOR_HAS_THREADS 1
+#else
+#define VEKTOR_HAS_THREADS 0
+#endif
+
+namespace Parallel {
+
+int hardware_threads() noexcept;
+
+// Thrown out of for_each_index and check_cancelled once the calling thread's stop token, set by a
+// CancellationScope, has been requested to stop.
+struct Cancelled : std::exception {
+  const char* what() const noexcept override {
+    return "operation cancelled";
+  }
+};
+
+// Makes `token` the calling thread's stop token for the lifetime of the scope. Work that
+// for_each_index hands to the pool is checked against the token of the thread that submitted it.
+class CancellationScope {
+public:
+  explicit CancellationScope(std::stop_token);
+  ~CancellationScope();
+
+  CancellationScope(const CancellationScope&) = delete;
+  CancellationScope& operator=(const CancellationScope&) = delete;
+
+private:
+  std::stop_token m_previous;
+};
+
+void check_cancelled();
+
+class ThreadPool {
+public:
+  // nr_threads counts the calling thread, so 1 runs everything inline.
+  explicit ThreadPool(int nr_threads = hardware_threads());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const noexcept;
+
+  // Calls f(i) for every i in [0, count) and returns once all calls are done; the calling thread
+  // takes part. The first exception thrown by f is rethrown here. Calls made while the pool is
+  // already busy, including nested ones, run inline. Indices not yet started when the submitting
+  // thread's stop token is requested throw Cancelled instead of running.
+  void for_each_index(int count, const std::function<void(int)>& f);
+
+private:
+  struct Job {
+    Job(const std::function<void(int)>& f, int count, std::stop_token token)
+        : f { f }, count { count }, token { std::move(token) } {}
+
+    const std::function<void(int)>& f;
+    int count;
+    std::stop_token token;
+    std::atomic<int> next = 0;
+    std::atomic<int> done = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+  };
+
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_finished;
+  Job* m_job = nullptr;
+  std::uint64_t m_generation = 0;
+  int m_active = 0;
+  bool m_stop = false;
+  std::mutex m_submit;
+
+  void worker_loop();
+  static void run(Job&);
+};
+
+// Process-wide pool used by the image stages. It is created on first use and never replaced, so
+// the reference stays valid; set_nr_threads sizes it and throws std::logic_error once it exists.
+ThreadPool& default_pool();
+void set_nr_threads(int);
+
+inline void for_each_index(int count, const std::function<void(int)>& f) {
+  default_pool().for_each_index(count, f);
+}
+
+}  // namespace Parallel
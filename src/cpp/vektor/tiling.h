@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace Image {
+
+// A band of whole rows. A stage writes rows [y_begin, y_end) and may read `halo` rows above and
+// below it straight from its (padded, read-only) input, so halos are never copied.
+struct Tile {
+  int y_begin, y_end;
+  int halo;
+};
+
+// Bands are sized to keep about TILE_BYTES of rows resident and to be several halos tall. The
+// split depends only on the image size and the halo, never on the thread count, so a stage gives
+// bit-identical results however many threads run it.
+constexpr std::size_t TILE_BYTES = std::size_t { 1 } << 18;
+constexpr int MIN_TILE_ROWS = 32;
+
+inline auto make_tiles(int width, int height, int halo) -> std::vector<Tile> {
+  const auto row_bytes = 16 * static_cast<std::size_t>(std::max(width, 1));
+  const int cache_rows = static_cast<int>(std::min<std::size_t>(TILE_BYTES / row_bytes, height));
+  const int rows = std::max({ MIN_TILE_ROWS, 8 * halo, cache_rows });
+
+  std::vector<Tile> tiles;
+  for (int y = 0; y < height; y += rows) {
+    tiles.push_back({ .y_begin = y, .y_end = std::min(y + rows, height), .halo = halo });
+  }
+  return tiles;
+}
+
+// Runs f(tile) for every tile on the default thread pool.
+inline void for_each_tile(int width, int height, int halo, auto&& f) {
+  auto tiles = make_tiles(width, height, halo);
+  Parallel::for_each_index(static_cast<int>(tiles.size()), [&](int i) { f(tiles[i]); });
+}
+
+// Image::apply over tiles: calls f(x, y) for every pixel, one tile per task.
+inline void apply_tiled(int width, int height, auto&& f) {
+  for_each_tile(width, height, 0, [&](const Tile& tile) {
+    for (int y = tile.y_begin; y < tile.y_end; ++y) {
+      for (int x = 0; x < width; ++x) {
+        f(x, y);
+      }
+    }
+  });
+}
+
+}  // namespace Image
@@ -2,10 +2,18 @@
 
 #include <algorithm>
 #include <array>
+#include <cstdint>
+#include <functional>
 #include <glm/glm.hpp>
+#include <numeric>
+#include <optional>
+#include <unordered_map>
 
 #include "bezier_curve.h"
 #include "image.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include "tiling.h"
 
 namespace rng = std::ranges;
 using Image::BinaryImage;
@@ -63,30 +71,55 @@ private:
   std::vector<std::vector<glm::ivec2>> dirs_map;
 };
 
-BinaryImage fix_image(const BinaryImage& img) {
-  auto result = img;
-
-  Image::apply(img.width(), img.height(), [&](int x, int y) {
-    if (img[x + 1, y] && img[x - 1, y]) {
-      if (img[x, y + 1] && !img[x, y + 2] && !img[x + 1, y + 1] && !img[x - 1, y + 1]) {
-        result[x, y] = 1;
-        result[x, y + 1] = 0;
-      }
+// Where a pixel sits on a one-pixel bump off a straight run, fix_image moves the bump into the
+// run: the centre pixel is set and the bump cleared. Bit i of each mask holds the test for the
+// centre `offset` pixels right of the pixel in bit i of word k, row y. The image needs a padding of
+// at least 2.
+struct Bumps {
+  BinaryImage::Word below, above, right, left;
+};
 
-      if (img[x, y - 1] && !img[x, y - 2] && !img[x + 1, y - 1] && !img[x - 1, y - 1]) {
-        result[x, y] = 1;
-        result[x, y - 1] = 0;
-      }
+Bumps find_bumps(const BinaryImage& img, int y, int k, int offset) noexcept {
+  using Word = BinaryImage::Word;
+  constexpr int W = BinaryImage::WORD_BITS;
+
+  // Bit i holds the pixel dx right and dy below the centre.
+  auto at = [&](int dx, int dy) -> Word {
+    const Word* row = img.row(y + dy);
+    const int shift = dx + offset;
+    const Word previous = k > 0 ? row[k - 1] : 0;
+    const Word next = k + 1 < img.words_per_row() ? row[k + 1] : 0;
+    if (shift > 0) return (row[k] >> shift) | (next << (W - shift));
+    if (shift < 0) return (row[k] << -shift) | (previous >> (W + shift));
+    return row[k];
+  };
 
-    } else if (img[x, y + 1] && img[x, y - 1]) {
-      if (img[x + 1, y] && !img[x + 2, y] && !img[x + 1, y + 1] && !img[x + 1, y - 1]) {
-        result[x, y] = 1;
-        result[x + 1, y] = 0;
-      }
+  const Word horizontal = at(1, 0) & at(-1, 0);
+  const Word vertical = ~horizontal & at(0, 1) & at(0, -1);
+  return {
+    .below = horizontal & at(0, 1) & ~at(0, 2) & ~at(1, 1) & ~at(-1, 1),
+    .above = horizontal & at(0, -1) & ~at(0, -2) & ~at(1, -1) & ~at(-1, -1),
+    .right = vertical & at(1, 0) & ~at(2, 0) & ~at(1, 1) & ~at(1, -1),
+    .left = vertical & at(-1, 0) & ~at(-2, 0) & ~at(-1, 1) & ~at(-1, -1),
+  };
+}
 
-      if (img[x - 1, y] && !img[x - 2, y] && !img[x - 1, y + 1] && !img[x - 1, y - 1]) {
-        result[x, y] = 1;
-        result[x - 1, y] = 0;
+// A pixel is never both a bump and a centre, so the fixes don't depend on the order they are
+// applied in and every word is set and cleared at once.
+BinaryImage fix_image(const BinaryImage& img) {
+  auto result = img;
+  const int height = img.height();
+
+  Image::for_each_tile(img.width(), height, 2, [&](Image::Tile tile) {
+    for (int y = tile.y_begin; y < tile.y_end; ++y) {
+      auto* row = result.row(y);
+      for (int k = 0; k < img.words_per_row(); ++k) {
+        auto centre = find_bumps(img, y, k, 0);
+        auto cleared = find_bumps(img, y, k, -1).right | find_bumps(img, y, k, 1).left;
+        if (y > 0) cleared |= find_bumps(img, y - 1, k, 0).below;
+        if (y + 1 < height) cleared |= find_bumps(img, y + 1, k, 0).above;
+
+        row[k] = (row[k] | centre.below | centre.above | centre.right | centre.left) & ~cleared;
       }
     }
   });
@@ -94,88 +127,141 @@ BinaryImage fix_image(const BinaryImage& img) {
   return result;
 }
 
-class PathFinder {
-public:
-  PathFinder(const BinaryImage& image)
-      : m_image { image }, visited { m_image.width(), m_image.height(), DirsMap::R } {}
+// fix_image for an image that only holds the given pixels, a pixel at a time rather than a word
+// at a time, so that the cost follows the number of pixels rather than the area. Every pixel is
+// checked for being the bump of each of its four neighbours against the image before any fix.
+void fix_pixels(BinaryImage& image, const std::vector<glm::ivec2>& pixels) {
+  auto at = [&](glm::ivec2 v) { return image[v.x, v.y]; };
+  constexpr glm::ivec2 directions[] { { 0, 1 }, { 0, -1 }, { 1, 0 }, { -1, 0 } };
+
+  std::vector<std::pair<glm::ivec2, glm::ivec2>> fixes;
+  for (auto bump : pixels) {
+    for (auto dir : directions) {
+      const glm::ivec2 centre = bump - dir, side { dir.y, dir.x };
+      bool is_bump = at(centre + side) && at(centre - side) && !at(bump + dir) &&
+                     !at(bump + side) && !at(bump - side);
+      // A centre on a horizontal run only takes the bumps above and below it.
+      if (dir.x != 0) is_bump = is_bump && !at(centre - dir);
+      if (is_bump) fixes.emplace_back(centre, bump);
+    }
+  }
 
-  glm::ivec2 search_corner(glm::ivec2 v, glm::ivec2 p = { -1, -1 }) {
-    visited[v.x, v.y] = true;
+  for (auto [centre, bump] : fixes) {
+    image[centre.x, centre.y] = true;
+  }
+  for (auto [centre, bump] : fixes) {
+    image[bump.x, bump.y] = false;
+  }
+}
 
-    glm::ivec2 corner = v;
-    const auto& dirs = (p.x == -1 ? dirs_map[{ 0, 0 }] : dirs_map[v - p]);
-    for (auto dir : dirs) {
-      auto u = v + dir;
-      if (visited[u.x, u.y] || !m_image[u.x, u.y]) continue;
-      corner = search_corner(u, v);
-      break;
+// Follows the paths of a fixed image, which needs a padding of at least DirsMap::R. Each
+// component is traced in an image of its own, so different components can be followed at once by
+// different PathFinders.
+class PathFinder {
+public:
+  PathFinder(const BinaryImage& image, std::size_t max_path_size)
+      : m_max_path_size { max_path_size },
+        m_image { image },
+        visited { image.width(), image.height(), DirsMap::R } {}
+
+  glm::ivec2 search_corner(glm::ivec2 v) {
+    m_chain.clear();
+    for (glm::ivec2 p = { -1, -1 };;) {
+      set_visited(v, true);
+      m_chain.push_back(v);
+
+      auto u = next_pixel(v, p);
+      if (!u) break;
+      p = v, v = *u;
     }
 
-    visited[v.x, v.y] = false;
-    return corner;
+    for (auto u : m_chain) {
+      set_visited(u, false);
+    }
+    return v;
   }
 
-  void search_path(std::vector<glm::ivec2>& path, glm::ivec2 v, glm::ivec2 p = { -1, -1 }) {
-    if (path.size() >= max_path_size) return;
-    visited[v.x, v.y] = true;
+  void search_path(std::vector<glm::ivec2>& path, glm::ivec2 v) {
+    for (glm::ivec2 p = { -1, -1 }; path.size() < m_max_path_size;) {
+      set_visited(v, true);
 
-    auto prev = (path.empty() ? v : path.back());
-    if (glm::max(glm::abs(v.x - prev.x), glm::abs(v.y - prev.y)) > 1) {
-      path.push_back((prev + v) / 2);
+      auto prev = (path.empty() ? v : path.back());
+      if (glm::max(glm::abs(v.x - prev.x), glm::abs(v.y - prev.y)) > 1) {
+        path.push_back((prev + v) / 2);
 
-    } else if (prev.x != v.x && prev.y != v.y) {
-      if (path.size() > 1) {
-        glm::ivec2 dir = prev - path.end()[-2];
-        glm::ivec2 next = prev + 2 * dir;
+      } else if (prev.x != v.x && prev.y != v.y) {
+        if (path.size() > 1) {
+          glm::ivec2 dir = prev - path.end()[-2];
+          glm::ivec2 next = prev + 2 * dir;
+
+          if (m_image[next.x, next.y]) {
+            path.push_back(v - dir);
+          } else {
+            path.push_back(prev + dir);
+          }
 
-        if (m_image[next.x, next.y]) {
-          path.push_back(v - dir);
         } else {
-          path.push_back(prev + dir);
+          path.push_back({ prev.x, v.y });
         }
-
-      } else {
-        path.push_back({ prev.x, v.y });
       }
-    }
-    path.push_back(v);
+      path.push_back(v);
 
-    const auto& dirs = (p.x == -1 ? dirs_map[{ 0, 0 }] : dirs_map[v - p]);
-    for (auto dir : dirs) {
-      auto u = v + dir;
-      if (visited[u.x, u.y] || !m_image[u.x, u.y]) continue;
-      search_path(path, u, v);
-      break;
+      auto u = next_pixel(v, p);
+      if (!u) break;
+      p = v, v = *u;
     }
   }
 
-  auto result() {
-    std::vector<std::vector<glm::ivec2>> paths;
+  // Follows paths from the seed until it has been visited, passing every path long enough to
+  // keep to emit(path).
+  void search_paths_from(glm::ivec2 seed, auto&& emit) {
+    while (!visited[seed.x, seed.y]) {
+      if (!m_image[seed.x, seed.y]) return;
 
-    Image::apply(m_image.width(), m_image.height(), [&](int x, int y) {
-      while (!visited[x, y]) {
-        if (!m_image[x, y]) return;
+      std::vector<glm::ivec2> path;
+      auto corner = search_corner(seed);
+      search_path(path, corner);
 
-        std::vector<glm::ivec2> path;
-        auto corner = search_corner({ x, y });
-        search_path(path, corner);
-
-        if (path.size() >= min_path_size) {
-          paths.emplace_back(std::move(path));
-        }
+      if (path.size() >= min_path_size) {
+        emit(std::move(path));
       }
-    });
-
-    return paths;
+    }
   }
 
 private:
-  static constexpr int min_path_size = 4;
-  static constexpr int max_path_size = 512;
+  static constexpr std::size_t min_path_size = 4;
+  const std::size_t m_max_path_size;
 
-  DirsMap dirs_map;
   const BinaryImage& m_image;
-  Image::Image<char> visited;
+  BinaryImage visited;
+  std::vector<glm::ivec2> m_chain;
+
+  void set_visited(glm::ivec2 v, bool value) noexcept {
+    visited[v.x, v.y] = value;
+  }
+
+  // First unvisited edge pixel next to v, preferring the direction we came from p in. The
+  // candidates in the (2R + 1)^2 window around v are gathered a row at a time, row dy of the
+  // window in bits (dy + R) * (2R + 1) onwards.
+  std::optional<glm::ivec2> next_pixel(glm::ivec2 v, glm::ivec2 p) const noexcept {
+    constexpr int R = DirsMap::R;
+    constexpr int SIZE = 2 * R + 1;
+
+    BinaryImage::Word candidates = 0;
+    for (int dy = -R; dy <= R; ++dy) {
+      auto row = m_image.bits(v.x - R, v.y + dy, SIZE) & ~visited.bits(v.x - R, v.y + dy, SIZE);
+      candidates |= row << ((dy + R) * SIZE);
+    }
+    if (candidates == 0) return std::nullopt;
+
+    // The same for every PathFinder, so built once, on first use, rather than per component.
+    static const DirsMap dirs_map;
+    const auto& dirs = (p.x == -1 ? dirs_map[{ 0, 0 }] : dirs_map[v - p]);
+    for (auto dir : dirs) {
+      if ((candidates >> ((dir.y + R) * SIZE + dir.x + R)) & 1) return v + dir;
+    }
+    return std::nullopt;
+  }
 };
 
 class PathTracer {
@@ -351,17 +437,39 @@ void PathTracer::compute_optimal_sequence() noexcept {
     clip0[i] = glm::max(i + 1, c);
   }
 
-  using Cost = std::pair<int, double>;
-  std::vector<Cost> dist(n, { INT_MAX, 0.0 });
+  // The fewest segments first, then the least penalty. clip0 never decreases, so j can be
+  // reached from i exactly when clip1[j] <= i. As in potrace, vertex s of a sequence with the
+  // fewest segments lies in [seg1[s], seg0[s]]: no further than s segments reach from the start,
+  // and no nearer than the rest reach back from the end. Only those vertices are tried, which
+  // keeps long straight runs linear and picks the same sequence as trying every pair.
+  std::vector<int> clip1(n);
+  for (int i = 0, j = 1; i < n; ++i) {
+    for (; j <= clip0[i] && j < n; ++j) {
+      clip1[j] = i;
+    }
+  }
+
+  std::vector<int> seg0 { 0 };
+  while (seg0.back() < n - 1) {
+    seg0.push_back(clip0[seg0.back()]);
+  }
+  const int nr_segments = static_cast<int>(seg0.size()) - 1;
+  std::vector<int> seg1(nr_segments + 1);
+  for (int s = nr_segments, i = n - 1; s > 0; --s) {
+    seg1[s] = i;
+    i = clip1[i];
+  }
+
+  std::vector<double> penalty(n);
   std::vector<int> prev(n, -1);
-  dist[0] = { 0, 0.0 };
-  for (int i = 0; i < n; ++i) {
-    if (dist[i].first == INT_MAX) continue;
-    for (int j = i + 1; j <= clip0[i]; ++j) {
-      Cost cand = { dist[i].first + 1, dist[i].second + compute_penalty(i, j) };
-      if (cand < dist[j]) {
-        dist[j] = cand;
-        prev[j] = i;
+  for (int s = 1; s <= nr_segments; ++s) {
+    for (int j = seg1[s]; j <= seg0[s]; ++j) {
+      for (int i = clip1[j]; i <= seg0[s - 1]; ++i) {
+        double candidate = penalty[i] + compute_penalty(i, j);
+        if (prev[j] < 0 || candidate < penalty[j]) {
+          penalty[j] = candidate;
+          prev[j] = i;
+        }
       }
     }
   }
@@ -581,35 +689,198 @@ void PathTracer::compute_bezier_curves() noexcept {
   }
 }
 
+// Fits the paths in parallel. Paths are handed out longest first, one at a time, so a long path
+// never starts last and leaves the other threads idle at the tail. Curves are scaled by `scale`
+// and land at their path's index.
+auto fit_paths(const std::vector<std::vector<glm::ivec2>>& paths, double scale)
+  -> std::vector<std::vector<BezierCurve>> {
+  std::vector<int> order(paths.size());
+  std::iota(order.begin(), order.end(), 0);
+  rng::stable_sort(order, std::greater<> {}, [&](int i) { return paths[i].size(); });
+
+  std::vector<std::vector<BezierCurve>> curve_vectors(paths.size());
+  Parallel::for_each_index(static_cast<int>(order.size()), [&](int i) {
+    PathTracer tracer { paths[order[i]] };
+    curve_vectors[order[i]] = tracer.bezier_curves();
+    for (auto& curve : curve_vectors[order[i]]) {
+      BezierCurve::scale(curve, scale);
+    }
+  });
+
+  return curve_vectors;
+}
+
+// Follows every path of a fixed image from its pixels in raster order and calls
+// emit(seed, path) for each path kept. The image lies at `origin` in an image `width` pixels wide,
+// where the paths are moved to and which the seeds are raster indices into.
+void follow_paths(
+  const BinaryImage& fixed_image,
+  glm::ivec2 origin,
+  int width,
+  std::size_t max_path_size,
+  auto&& emit
+) {
+  PathFinder path_finder { fixed_image, max_path_size };
+  fixed_image.for_each_set([&](int x, int y) {
+    path_finder.search_paths_from({ x, y }, [&](std::vector<glm::ivec2>&& path) {
+      for (auto& pixel : path) {
+        pixel += origin;
+      }
+      emit((y + origin.y) * width + x + origin.x, std::move(path));
+    });
+  });
+}
+
+std::uint64_t mix(std::uint64_t seed, std::uint64_t value) noexcept {
+  std::uint64_t x = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
 namespace Tracer {
 
-auto trace(const BinaryImage& image) -> std::vector<BezierCurve> {
-  auto fixed_image = fix_image(image);
+auto trace(const BinaryImage& image, std::size_t max_path_size) -> std::vector<BezierCurve> {
+  const int width = image.width();
+  Profiler::count(Profiler::Counter::pixels, static_cast<std::int64_t>(width) * image.height());
 
-  PathFinder path_finder { fixed_image };
-  auto paths = path_finder.result();
+  std::vector<std::vector<glm::ivec2>> paths;
+  follow_paths(fix_image(image), {}, width, max_path_size, [&](int, auto&& path) {
+    paths.emplace_back(std::move(path));
+  });
 
-  std::vector<std::vector<BezierCurve>> curve_vectors;
-  curve_vectors.reserve(paths.size());
-  std::size_t total_size = 0;
-  for (const auto& path : paths) {
-    PathTracer tracer { path };
-    curve_vectors.emplace_back(std::move(tracer.bezier_curves()));
-    total_size += curve_vectors.back().size();
+  std::vector<BezierCurve> curves;
+  for (auto& path_curves : fit_paths(paths, 1.0 / width)) {
+    curves.append_range(path_curves);
   }
+  Profiler::count(Profiler::Counter::paths, paths.size());
+  Profiler::count(Profiler::Counter::curves, curves.size());
+  return curves;
+}
 
-  std::vector<BezierCurve> curves;
-  curves.reserve(total_size);
-  for (const auto& v : curve_vectors) {
-    curves.append_range(v);
+auto trace(int width, const std::vector<ComponentPixels>& components, std::size_t max_path_size)
+  -> std::vector<BezierCurve> {
+  return merge_components(trace_components(width, components, {}, max_path_size));
+}
+
+auto trace_components(
+  int width,
+  const std::vector<ComponentPixels>& component_pixels,
+  const std::vector<ComponentCurves>& previous,
+  std::size_t max_path_size
+) -> std::vector<ComponentCurves> {
+  const int nr_components = static_cast<int>(component_pixels.size());
+
+  std::unordered_map<std::uint64_t, const ComponentCurves*> reusable;
+  for (const auto& component : previous) {
+    reusable.emplace(component.fingerprint, &component);
   }
 
-  double scale = 1.0 / image.width();
-  for (auto& curve : curves) {
-    BezierCurve::scale(curve, scale);
+  // Components are followed in parallel, each in an image of its bounding box with its bumps
+  // fixed there, unless they can be reused. Their paths are then fitted together.
+  std::vector<ComponentCurves> components(nr_components);
+  std::vector<std::vector<std::vector<glm::ivec2>>> component_paths(nr_components);
+  std::vector<std::int64_t> nr_pixels(nr_components);
+  Parallel::for_each_index(nr_components, [&](int c) {
+    const auto pixels = component_pixels[c];
+
+    // Fingerprints cover everything the curves of a component depend on.
+    auto& component = components[c];
+    component.fingerprint = mix(mix(0, width), max_path_size);
+    for (int pixel : pixels) {
+      component.fingerprint = mix(component.fingerprint, pixel);
+    }
+
+    if (auto it = reusable.find(component.fingerprint); it != reusable.end()) {
+      component = *it->second;
+      return;
+    }
+    if (pixels.empty()) return;
+    nr_pixels[c] = static_cast<std::int64_t>(pixels.size());
+
+    // The pixels are in raster order, so only the columns need looking at for the bounds.
+    glm::ivec2 min { width, pixels.front() / width }, max { -1, pixels.back() / width };
+    for (int pixel : pixels) {
+      min.x = std::min(min.x, pixel % width);
+      max.x = std::max(max.x, pixel % width);
+    }
+
+    BinaryImage image { max.x - min.x + 1, max.y - min.y + 1, DirsMap::R };
+    std::vector<glm::ivec2> local_pixels;
+    local_pixels.reserve(pixels.size());
+    for (int pixel : pixels) {
+      glm::ivec2 local { pixel % width - min.x, pixel / width - min.y };
+      image[local.x, local.y] = true;
+      local_pixels.push_back(local);
+    }
+    fix_pixels(image, local_pixels);
+    follow_paths(image, min, width, max_path_size, [&](int seed, auto&& path) {
+      component.seeds.push_back(seed);
+      component_paths[c].emplace_back(std::move(path));
+    });
+  });
+  Profiler::count(
+    Profiler::Counter::pixels, std::accumulate(nr_pixels.begin(), nr_pixels.end(), std::int64_t {})
+  );
+
+  std::vector<std::vector<glm::ivec2>> paths;
+  std::vector<int> path_components;
+  for (int c = 0; c < nr_components; ++c) {
+    for (auto& path : component_paths[c]) {
+      paths.emplace_back(std::move(path));
+      path_components.push_back(c);
+    }
   }
 
+  auto curve_vectors = fit_paths(paths, 1.0 / width);
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    auto& component = components[path_components[i]];
+    if (component.offsets.empty()) component.offsets.push_back(0);
+    component.curves.append_range(curve_vectors[i]);
+    component.offsets.push_back(static_cast<int>(component.curves.size()));
+  }
+
+  // Reused components count too, so incremental traces report what the result holds.
+  std::size_t nr_paths = 0, nr_curves = 0;
+  for (const auto& component : components) {
+    nr_paths += component.seeds.size();
+    nr_curves += component.curves.size();
+  }
+  Profiler::count(Profiler::Counter::paths, nr_paths);
+  Profiler::count(Profiler::Counter::curves, nr_curves);
+  return components;
+}
+
+void for_each_path_in_order(
+  const std::vector<ComponentCurves>& components,
+  const std::function<void(int, int)>& f
+) {
+  // A seed belongs to a single component, so ordering by seed alone interleaves the components
+  // the way the whole-image scan does, and the stable sort keeps the paths of one seed in order.
+  std::vector<std::pair<int, int>> paths;
+  for (int c = 0; c < static_cast<int>(components.size()); ++c) {
+    for (int p = 0; p < static_cast<int>(components[c].seeds.size()); ++p) {
+      paths.emplace_back(c, p);
+    }
+  }
+  rng::stable_sort(paths, {}, [&](std::pair<int, int> path) {
+    return components[path.first].seeds[path.second];
+  });
+
+  for (auto [c, p] : paths) {
+    f(c, p);
+  }
+}
+
+auto merge_components(const std::vector<ComponentCurves>& components) -> std::vector<BezierCurve> {
+  std::vector<BezierCurve> curves;
+  for_each_path_in_order(components, [&](int c, int p) {
+    const auto& component = components[c];
+    auto first = component.curves.begin() + component.offsets[p];
+    auto last = component.curves.begin() + component.offsets[p + 1];
+    curves.insert(curves.end(), first, last);
+  });
   return curves;
 }
 
-}  // namespace Tracer
\ No newline at end of file
+}  // namespace Tracer
@@ -1,9 +1,60 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <span>
+#include <vector>
+
 #include "bezier_curve.h"
 #include "image.h"
 
 namespace Tracer {
 
-auto trace(const Image::BinaryImage&) -> std::vector<BezierCurve>;
+// Paths longer than this are split into several. Path following uses constant stack space, so
+// by default every path is kept whole and fitted in one piece.
+constexpr std::size_t default_max_path_size = std::numeric_limits<std::size_t>::max();
+
+auto trace(const Image::BinaryImage&, std::size_t = default_max_path_size)
+  -> std::vector<BezierCurve>;
+
+// The pixels of one edge component, as raster indices in raster order into an image some width
+// wide, such as the components Canny::kept_components returns. Each component is traced on its
+// own: its bumps are fixed without looking at other components and its paths never leave it.
+using ComponentPixels = std::span<const int>;
+
+// trace() straight from the components of the edges, without an image of them.
+auto trace(int, const std::vector<ComponentPixels>&, std::size_t = default_max_path_size)
+  -> std::vector<BezierCurve>;
+
+// The curves of one component. They depend on nothing but the component's pixels, so they stay
+// valid for as long as its fingerprint does not change.
+struct ComponentCurves {
+  std::uint64_t fingerprint;
+
+  // Path i starts from the pixel with raster index seeds[i] and consists of curves[offsets[i]]
+  // up to curves[offsets[i + 1]].
+  std::vector<int> seeds;
+  std::vector<int> offsets;
+  std::vector<BezierCurve> curves;
+};
+
+// trace() from components, keeping the curves of each: components with a fingerprint found in
+// `previous` are copied from there, and only the others are traced.
+auto trace_components(
+  int,
+  const std::vector<ComponentPixels>&,
+  const std::vector<ComponentCurves>& = {},
+  std::size_t = default_max_path_size
+) -> std::vector<ComponentCurves>;
+
+// Calls f(component, path) for every path, in the order trace() returns their curves.
+void for_each_path_in_order(
+  const std::vector<ComponentCurves>&,
+  const std::function<void(int, int)>&
+);
+
+// The curves of all components, as trace() would return them.
+auto merge_components(const std::vector<ComponentCurves>&) -> std::vector<BezierCurve>;
 
 }  // namespace Tracer
\ No newline at end of file
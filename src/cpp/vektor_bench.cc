@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <glm/glm.hpp>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vektor/bezier_curve.h"
+#include "vektor/canny_edge_detector.h"
+#include "vektor/gradient_kernel.h"
+#include "vektor/image.h"
+#include "vektor/planar_image.h"
+#include "vektor/renderer.h"
+#include "vektor/thread_pool.h"
+#include "vektor/tracer.h"
+
+// Runs every stage on synthetic inputs and reports the fastest of several runs. With --json, each
+// measurement is printed as one JSON object per line, so runs can be diffed and post-processed.
+// Every input is first checked against the scalar structure tensor, and a mismatch fails the run.
+//
+//   vektor_bench [--sizes 256,512,1024] [--repeats 5] [--json] [-j <threads>]
+
+namespace {
+
+std::uint64_t hash(std::uint64_t x) noexcept {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+float noise(int x, int y, int channel) noexcept {
+  auto position = static_cast<std::uint64_t>(y) << 32 | static_cast<std::uint32_t>(x);
+  auto h = hash(position * 3 + channel);
+  return static_cast<float>(h >> 40) / static_cast<float>(1 << 24);
+}
+
+// Independent per-pixel noise: edges everywhere, the worst case for every stage after the blur.
+glm::vec3 noise_pixel(int x, int y, int) {
+  return { noise(x, y, 0), noise(x, y, 1), noise(x, y, 2) };
+}
+
+// Dark rings and diagonals on white, about two pixels wide at every size.
+glm::vec3 line_art_pixel(int x, int y, int size) {
+  float u = static_cast<float>(x) / size, v = static_cast<float>(y) / size;
+  float pixel = 1.0f / size;
+
+  float ring = std::hypot(u - 0.5f, v - 0.5f) * 12.0f;
+  float ring_distance = std::abs(ring - std::round(ring)) / 12.0f;
+  float diagonal_distance = std::abs(std::fmod(u + v, 0.125f) - 0.0625f) * 0.7071f;
+  bool ink = std::min(ring_distance, diagonal_distance) < pixel;
+  return glm::vec3(ink ? 0.05f : 0.95f);
+}
+
+// Smooth shading with a few soft-edged shapes and mild sensor noise.
+glm::vec3 photo_pixel(int x, int y, int size) {
+  float u = static_cast<float>(x) / size, v = static_cast<float>(y) / size;
+  glm::vec3 color {
+    0.5f + 0.3f * std::sin(3.1f * u + 1.7f * v),
+    0.5f + 0.3f * std::sin(2.3f * v - 1.1f * u + 1.0f),
+    0.5f + 0.3f * std::cos(4.7f * u * v),
+  };
+
+  for (int i = 0; i < 8; ++i) {
+    float cx = noise(i, 0, 0), cy = noise(i, 0, 1), radius = 0.05f + 0.15f * noise(i, 0, 2);
+    float edge = std::clamp((radius - std::hypot(u - cx, v - cy)) * size / 3.0f, 0.0f, 1.0f);
+    color = glm::mix(color, glm::vec3(noise(i, 1, 0), noise(i, 1, 1), noise(i, 1, 2)), edge);
+  }
+
+  return glm::clamp(color + 0.04f * (noise(x, y, 0) - 0.5f), 0.0f, 1.0f);
+}
+
+Image::RGBImage make_input(int size, glm::vec3 (*pixel)(int, int, int)) {
+  Image::RGBImage image { size, size, Canny::padding_requirement };
+  Image::apply(size, size, [&](int x, int y) { image[x, y] = pixel(x, y, size); });
+  return image;
+}
+
+// Pixels where the SIMD structure tensor, of either layout, differs from the scalar reference.
+std::int64_t structure_tensor_mismatches(const Image::RGBImage& image) {
+  Canny::StructureTensorRow reference;
+  std::int64_t mismatches = 0;
+  auto compare = [&](int y, const Canny::StructureTensorRow& row) {
+    Canny::evaluate_structure_tensor_reference(image, y, reference);
+    for (int x = 0; x < image.width(); ++x) {
+      mismatches += row.a[x] != reference.a[x] || row.b[x] != reference.b[x] ||
+                    row.c[x] != reference.c[x];
+    }
+  };
+  Canny::for_each_structure_tensor_row(image, 0, image.height(), compare);
+  Image::PlanarRGBImage planar { image, Canny::padding_requirement };
+  Canny::for_each_structure_tensor_row(planar, 0, image.height(), compare);
+  return mismatches;
+}
+
+struct Measurement {
+  std::string input;
+  int size;
+  std::string stage;
+  double milliseconds;
+  std::size_t curves = 0;
+};
+
+// Runs f `repeats` times and keeps the fastest run along with its result.
+template <typename F>
+auto measure(int repeats, double& milliseconds, F&& f) {
+  milliseconds = std::numeric_limits<double>::infinity();
+  decltype(f()) result;
+  for (int i = 0; i < repeats; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    result = f();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    milliseconds = std::min(milliseconds, elapsed.count());
+  }
+  return result;
+}
+
+std::vector<int> parse_sizes(const std::string& list) {
+  std::vector<int> sizes;
+  for (std::size_t begin = 0; begin <= list.size();) {
+    auto end = std::min(list.find(',', begin), list.size());
+    sizes.push_back(std::stoi(list.substr(begin, end - begin)));
+    begin = end + 1;
+  }
+  return sizes;
+}
+
+void print(const Measurement& m, bool json) {
+  double seconds = m.milliseconds / 1000.0;
+  double megapixels = static_cast<double>(m.size) * m.size / 1e6;
+  if (json) {
+    std::cout << std::format(
+      "{{\"input\":\"{}\",\"width\":{},\"height\":{},\"stage\":\"{}\",\"milliseconds\":{:.4f},"
+      "\"megapixels_per_second\":{:.3f},\"curves\":{},\"curves_per_second\":{:.1f}}}\n",
+      m.input,
+      m.size,
+      m.size,
+      m.stage,
+      m.milliseconds,
+      megapixels / seconds,
+      m.curves,
+      m.curves / seconds
+    );
+    return;
+  }
+
+  std::cout << std::format(
+    "{:<10}{:>6}  {:<12}{:>10.3f} ms{:>10.1f} MP/s",
+    m.input,
+    m.size,
+    m.stage,
+    m.milliseconds,
+    megapixels / seconds
+  );
+  if (m.curves > 0) std::cout << std::format("{:>12.0f} curves/s", m.curves / seconds);
+  std::cout << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::map<std::string, std::string> args;
+  args["--sizes"] = "256,512,1024";
+  args["--repeats"] = "5";
+
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 < argc && argv[i][0] == '-' && argv[i + 1][0] != '-') {
+      args[std::string { argv[i] }] = std::string { argv[i + 1] };
+    } else {
+      args[std::string { argv[i] }] = "";
+    }
+  }
+
+  try {
+    if (args.contains("-j")) {
+      Parallel::set_nr_threads(std::stoi(args["-j"]));
+    }
+
+    const bool json = args.contains("--json");
+    const int repeats = std::max(1, std::stoi(args["--repeats"]));
+
+    const std::pair<const char*, glm::vec3 (*)(int, int, int)> inputs[] {
+      { "noise", noise_pixel },
+      { "line_art", line_art_pixel },
+      { "photo", photo_pixel },
+    };
+
+    for (int size : parse_sizes(args["--sizes"])) {
+      for (auto [name, pixel] : inputs) {
+        auto source = make_input(size, pixel);
+        if (auto mismatches = structure_tensor_mismatches(source); mismatches > 0) {
+          throw std::runtime_error(std::format(
+            "The structure tensor of {} {} differs from the reference at {} pixels",
+            name,
+            size,
+            mismatches
+          ));
+        }
+        auto record = [&](const char* stage, double milliseconds, std::size_t curves = 0) {
+          print({ name, size, stage, milliseconds, curves }, json);
+        };
+
+        // Each stage runs on the output of the one before, as in the pipeline.
+        double ms;
+        auto blurred = measure(repeats, ms, [&] { return Canny::apply_adaptive_blur(source); });
+        record("blur", ms);
+        auto gradient = measure(repeats, ms, [&] { return Canny::compute_gradient(blurred); });
+        record("gradient", ms);
+        auto thinned = measure(repeats, ms, [&] { return Canny::thin_edges(gradient); });
+        record("thinning", ms);
+        auto [tl, th] = measure(repeats, ms, [&] { return Canny::compute_threshold(thinned); });
+        record("threshold", ms);
+        auto components =
+          measure(repeats, ms, [&] { return Canny::label_weak_components(thinned, tl, th); });
+        record("hysteresis", ms);
+
+        auto traced = measure(repeats, ms, [&] {
+          return Tracer::trace(size, Canny::kept_components(components));
+        });
+        record("trace", ms, traced.size());
+
+        std::vector<BezierCurveWithColor> curves(traced.begin(), traced.end());
+        measure(repeats, ms, [&] { return Renderer::render_greyscale(size, size, curves); });
+        record("render", ms, curves.size());
+      }
+    }
+
+  } catch (const std::exception& e) {
+    std::cerr << "Exception occured: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
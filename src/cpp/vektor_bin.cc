@@ -1,57 +1,366 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <format>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "vektor/bezier_curve.h"
 #include "vektor/canny_edge_detector.h"
 #include "vektor/image_io.h"
+#include "vektor/profiler.h"
 #include "vektor/renderer.h"
+#include "vektor/thread_pool.h"
 #include "vektor/tracer.h"
 
-int main(int argc, char** argv) {
-  if (argc < 2) {
-    return -1;
-  }
+namespace {
 
-  std::map<std::string, std::string> args;
-  args["-o"] = "output.png";
-  args["-s"] = "1.0";
+namespace fs = std::filesystem;
 
-  for (int i = 2; i < argc; ++i) {
-    if (i + 1 < argc && argv[i][0] == '-') {
-      args[std::string { argv[i] }] = std::string { argv[i + 1] };
-    } else {
-      args[std::string { argv[i] }] = "";
+// Rough peak of what one image holds while it is processed, per source pixel: the float RGB
+// source and blur buffers, the gradient, the thinned and binary images and the tracer's copies.
+constexpr std::size_t bytes_per_pixel = 64;
+
+struct Options {
+  float scale = 1.0f;
+  bool color = false;
+  bool curves = false;
+};
+
+struct Result {
+  int width = 0;
+  int height = 0;
+  std::size_t nr_curves = 0;
+};
+
+// One curve per line: the four control points in output pixels, then the colour with -c.
+void write_curves(
+  std::ostream& stream,
+  const std::vector<BezierCurveWithColor>& curves,
+  int width,
+  bool color
+) {
+  for (const auto& [curve, rgb] : curves) {
+    for (auto p : { curve.p0, curve.p1, curve.p2, curve.p3 }) {
+      stream << p.x * width << ' ' << p.y * width << ' ';
     }
+    if (color) stream << rgb.r << ' ' << rgb.g << ' ' << rgb.b;
+    stream << '\n';
   }
+  if (!stream) throw std::runtime_error("Could not write the curves");
+}
 
-  try {
-    std::string path { argv[1] };
-    auto source_image = Image::load(path.c_str(), Canny::padding_requirement);
-    auto canny_result = Canny::detect_edges(source_image);
-    auto curves = Tracer::trace(canny_result);
-    std::vector<BezierCurveWithColor> colored_curves(curves.begin(), curves.end());
+// "-" reads the encoded image from stdin and writes the result to stdout.
+Result vectorize(const std::string& input_path, const std::string& output_path, Options options) {
+  using Profiler::timed;
+  auto source_image = timed("load", [&] {
+    if (input_path == "-") return Image::load(std::cin, Canny::padding_requirement);
+    return Image::load(input_path.c_str(), Canny::padding_requirement);
+  });
+  auto components = Canny::detect_edge_components(source_image);
+  auto curves = timed("tracing", [&] {
+    return Tracer::trace(source_image.width(), Canny::kept_components(components));
+  });
+  std::vector<BezierCurveWithColor> colored_curves(curves.begin(), curves.end());
 
-    int width = source_image.width() * std::stof(args["-s"]);
-    int height = source_image.height() * std::stof(args["-s"]);
+  int width = source_image.width() * options.scale;
+  int height = source_image.height() * options.scale;
 
-    std::string output_path = args["-o"];
-    if (args.contains("-c")) {
+  if (options.color) {
+    timed("coloring", [&] {
       for (auto& [curve, color] : colored_curves) {
         color = Renderer::compute_curve_color(curve, source_image);
       }
+    });
+  }
+
+  auto save = [&](auto&& write) {
+    timed("save", [&] {
+      if (output_path == "-") {
+        write(std::cout);
+        if (!std::cout.flush()) throw std::runtime_error("Could not write to stdout");
+      } else {
+        std::ofstream file { output_path, std::ios::binary };
+        if (!file) throw std::runtime_error("Could not write: " + output_path);
+        write(file);
+        file.close();
+        if (!file) throw std::runtime_error("Could not write: " + output_path);
+      }
+    });
+  };
+
+  if (options.curves) {
+    save([&](std::ostream& stream) { write_curves(stream, colored_curves, width, options.color); });
+  } else if (options.color) {
+    auto result = timed("plotting", [&] {
+      return Renderer::render_color(width, height, colored_curves);
+    });
+    save([&](std::ostream& stream) { Image::save_as_png(result, stream); });
+  } else {
+    auto result = timed("plotting", [&] {
+      return Renderer::render_greyscale(width, height, colored_curves);
+    });
+    save([&](std::ostream& stream) { Image::save_as_png(result, stream); });
+  }
+
+  return { source_image.width(), source_image.height(), curves.size() };
+}
+
+// Admits work while the bytes in flight stay within the budget. A request larger than the whole
+// budget waits until nothing else is in flight and then runs alone.
+class MemoryBudget {
+public:
+  explicit MemoryBudget(std::size_t bytes) : m_budget { bytes }, m_available { bytes } {}
+
+  std::size_t acquire(std::size_t bytes) {
+    bytes = std::min(bytes, m_budget);
+    std::unique_lock lock { m_mutex };
+    m_released.wait(lock, [&] { return m_available >= bytes; });
+    m_available -= bytes;
+    return bytes;
+  }
+
+  void release(std::size_t bytes) {
+    {
+      std::lock_guard lock { m_mutex };
+      m_available += bytes;
+    }
+    m_released.notify_all();
+  }
+
+private:
+  std::size_t m_budget;
+  std::size_t m_available;
+  std::mutex m_mutex;
+  std::condition_variable m_released;
+};
 
-      auto result = Renderer::render_color(width, height, colored_curves);
-      Image::save_as_png(result, output_path.c_str());
+bool is_image_file(const fs::path& path) {
+  static const std::set<std::string> extensions {
+    ".png", ".jpg", ".jpeg", ".bmp", ".tga", ".gif", ".psd", ".hdr", ".pic", ".pnm", ".ppm", ".pgm"
+  };
+  auto extension = path.extension().string();
+  std::ranges::transform(extension, extension.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return extensions.contains(extension);
+}
 
+// Expands directories to the image files directly inside them, in name order, and "-" to the
+// paths listed on stdin, one per line.
+std::vector<std::string> collect_inputs(const std::vector<std::string>& arguments) {
+  std::vector<std::string> inputs;
+  for (const auto& argument : arguments) {
+    if (argument == "-") {
+      for (std::string line; std::getline(std::cin, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) inputs.push_back(line);
+      }
+    } else if (fs::is_directory(argument)) {
+      std::vector<std::string> files;
+      for (const auto& entry : fs::directory_iterator { argument }) {
+        if (entry.is_regular_file() && is_image_file(entry.path())) {
+          files.push_back(entry.path().string());
+        }
+      }
+      std::ranges::sort(files);
+      inputs.append_range(files);
     } else {
-      auto result = Renderer::render_greyscale(width, height, colored_curves);
-      Image::save_as_png(result, output_path.c_str());
+      inputs.push_back(argument);
+    }
+  }
+  return inputs;
+}
+
+std::string output_path_for(const std::string& output_template, const std::string& input_path) {
+  auto stem = fs::path { input_path }.stem().string();
+  auto output = output_template;
+  for (auto i = output.find("{stem}"); i != std::string::npos; i = output.find("{stem}", i)) {
+    output.replace(i, 6, stem);
+    i += stem.size();
+  }
+  return output;
+}
+
+// Runs the images concurrently on the thread pool, one image per thread, and prints a line per
+// image as it finishes and a summary at the end. Returns the number of images that failed.
+int run_batch(
+  const std::vector<std::string>& inputs,
+  const std::string& output_template,
+  Options options,
+  std::size_t memory_budget
+) {
+  using Clock = std::chrono::steady_clock;
+
+  MemoryBudget budget { memory_budget };
+  std::mutex output_mutex;
+  std::atomic<int> nr_failed = 0;
+  std::atomic<std::int64_t> total_pixels = 0;
+  std::atomic<std::int64_t> total_curves = 0;
+
+  // Inputs with the same stem would write the same file from two threads at once; only the first
+  // of them runs and the others fail.
+  std::vector<std::string> outputs;
+  std::vector<int> first_with_output;
+  std::map<std::string, int> first_input_of;
+  for (int i = 0; i < static_cast<int>(inputs.size()); ++i) {
+    outputs.push_back(output_path_for(output_template, inputs[i]));
+    auto normal = fs::path { outputs[i] }.lexically_normal().string();
+    first_with_output.push_back(first_input_of.try_emplace(normal, i).first->second);
+  }
+
+  auto batch_start = Clock::now();
+  Parallel::for_each_index(static_cast<int>(inputs.size()), [&](int i) {
+    const auto& input = inputs[i];
+    const auto& output = outputs[i];
+    try {
+      if (int first = first_with_output[i]; first != i) {
+        throw std::runtime_error(output + " is already the output of " + inputs[first]);
+      }
+
+      auto [width, height] = Image::load_size(input.c_str());
+      auto bytes = static_cast<std::size_t>(width) * height * bytes_per_pixel;
+      bytes += static_cast<std::size_t>(width * options.scale) * (height * options.scale) *
+               (options.color ? 24 : 8);
+
+      bytes = budget.acquire(bytes);
+      auto start = Clock::now();
+      Result result;
+      try {
+        auto parent = fs::path { output }.parent_path();
+        if (!parent.empty()) fs::create_directories(parent);
+        result = vectorize(input, output, options);
+      } catch (...) {
+        budget.release(bytes);
+        throw;
+      }
+      budget.release(bytes);
+
+      std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+      auto pixels = static_cast<std::int64_t>(result.width) * result.height;
+      total_pixels += pixels;
+      total_curves += result.nr_curves;
+
+      std::lock_guard lock { output_mutex };
+      std::cout << std::format(
+        "ok    {} -> {}  {}x{}  {:.1f} ms  {:.2f} MP/s  {} curves\n",
+        input,
+        output,
+        result.width,
+        result.height,
+        elapsed.count(),
+        pixels / 1e3 / elapsed.count(),
+        result.nr_curves
+      );
+
+    } catch (const std::exception& e) {
+      ++nr_failed;
+      std::lock_guard lock { output_mutex };
+      std::cout << std::format("fail  {}: {}\n", input, e.what());
+    }
+  });
+  std::chrono::duration<double> elapsed = Clock::now() - batch_start;
+
+  const int nr_succeeded = static_cast<int>(inputs.size()) - nr_failed;
+  std::cout << std::format(
+    "{} succeeded, {} failed in {:.2f} s: {:.2f} images/s, {:.2f} MP/s, {:.0f} curves/s\n",
+    nr_succeeded,
+    nr_failed.load(),
+    elapsed.count(),
+    nr_succeeded / elapsed.count(),
+    total_pixels / 1e6 / elapsed.count(),
+    total_curves / elapsed.count()
+  );
+  return nr_failed;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  // Options that always take a value; everything else that doesn't start with '-' is an input.
+  const std::set<std::string> valued_options { "-o", "-s", "-j", "--memory-budget" };
+
+  std::map<std::string, std::string> args;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg { argv[i] };
+    if (valued_options.contains(arg) && i + 1 < argc) {
+      args[arg] = argv[++i];
+    } else if (arg == "--profile" && i + 1 < argc && std::string { argv[i + 1] } == "json") {
+      args[arg] = argv[++i];
+    } else if (arg.starts_with('-') && arg != "-") {
+      args[arg] = "";
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  const bool batch = args.contains("--batch");
+  if (inputs.empty() || (!batch && inputs.size() > 1)) {
+    return -1;
+  }
+
+  try {
+    if (args.contains("-j")) {
+      Parallel::set_nr_threads(std::stoi(args["-j"]));
+    }
+
+    Options options;
+    if (args.contains("-s")) options.scale = std::stof(args["-s"]);
+    options.color = args.contains("-c");
+    options.curves = args.contains("--curves");
+
+    if (batch) {
+      std::string output_template = options.curves ? "{stem}_vektor.txt" : "{stem}_vektor.png";
+      if (args.contains("-o")) output_template = args["-o"];
+      if (!output_template.contains("{stem}")) {
+        throw std::invalid_argument("The output of a batch must contain {stem}");
+      }
+
+      std::size_t memory_budget = 1024;
+      if (args.contains("--memory-budget")) memory_budget = std::stoull(args["--memory-budget"]);
+      memory_budget <<= 20;
+
+      int nr_failed = run_batch(collect_inputs(inputs), output_template, options, memory_budget);
+      return nr_failed == 0 ? 0 : 1;
+    }
+
+    // --profile prints the time of each stage and what it counted to stderr; --profile json
+    // prints the same as JSON to stdout.
+    Profiler::Profile profile;
+    std::optional<Profiler::Session> session;
+    if (args.contains("--profile")) session.emplace(profile);
+
+    std::string output_path = options.curves ? "output.txt" : "output.png";
+    if (args.contains("-o")) output_path = args["-o"];
+    vectorize(inputs.front(), output_path, options);
+
+    if (session) {
+      session.reset();
+      if (args["--profile"] == "json") {
+        // Kept off stdout when the result went there.
+        (output_path == "-" ? std::cerr : std::cout) << profile.to_json() << std::endl;
+      } else {
+        std::cerr << profile.to_string();
+      }
     }
 
   } catch (const std::exception& e) {
-    std::cerr << "Exception occured: {}" << e.what() << std::endl;
+    std::cerr << "Exception occured: " << e.what() << std::endl;
+    return 1;
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -9,8 +9,7 @@ using namespace Vektor;
 struct ImageView {
   ImageView() = default;
 
-  template <typename T>
-  ImageView(std::string_view name, const ImageWithBytes<T>& image) : name { name } {
+  ImageView(std::string_view name, const auto& image) : name { name } {
     if (image.width() == 0 || image.height() == 0) {
       width = height = 0;
       data = val::null();
@@ -48,16 +47,7 @@ void set_pipeline_source_image(Pipeline& pipeline, val image_data) {
 
   auto width = image_data["width"].as<int>();
   auto height = image_data["height"].as<int>();
-
-  auto it = buffer.begin();
-  Image::RGBAImage image(width, height);
-  Image::apply(width, height, [&](int x, int y) {
-    auto color = glm::vec4(it[0], it[1], it[2], it[3]) / 255.0f;
-    image[x, y] = color;
-    it += 4;
-  });
-
-  pipeline.set_source_image(std::move(image));
+  pipeline.set_source_image(std::move(buffer), width, height);
 }
 
 val get_pipeline_image_views(const Pipeline& pipeline) {
@@ -84,6 +74,10 @@ val get_pipeline_curves(const Pipeline& pipeline) {
   return val::array(pipeline.curves());
 }
 
+val get_pipeline_profile(const Pipeline& pipeline) {
+  return val::global("JSON").call<val>("parse", pipeline.profile().to_json());
+}
+
 EMSCRIPTEN_BINDINGS(my_module) {
   enum_<PipelineConfig::BackgroundColor>("BackgroundColor")
     .value("black", PipelineConfig::BackgroundColor::black)
@@ -128,7 +122,11 @@ EMSCRIPTEN_BINDINGS(my_module) {
     .constructor()
     .function("setSourceImage", &set_pipeline_source_image)
     .function("setConfig", &Pipeline::set_config)
+    .function("setConfigAsync", &Pipeline::set_config_async)
+    .function("poll", &Pipeline::poll)
+    .function("setProfiling", &Pipeline::set_profiling)
     .property("config", &Pipeline::config)
     .property("imageViews", &get_pipeline_image_views, return_value_policy::take_ownership())
-    .property("curves", &get_pipeline_curves, return_value_policy::take_ownership());
+    .property("curves", &get_pipeline_curves, return_value_policy::take_ownership())
+    .property("profile", &get_pipeline_profile, return_value_policy::take_ownership());
 }
\ No newline at end of file
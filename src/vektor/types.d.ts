@@ -26,7 +26,11 @@ export interface Pipeline extends ClassHandle {
   readonly config: PipelineConfig;
   readonly imageViews: any;
   readonly curves: any;
+  readonly profile: any;
+  poll(): boolean;
   setConfig(_0: PipelineConfig): void;
+  setConfigAsync(_0: PipelineConfig): void;
+  setProfiling(_0: boolean): void;
   setSourceImage(_0: any): void;
 }
 